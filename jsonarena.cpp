@@ -0,0 +1,140 @@
+/*
+ * Tilemap Town native client
+ *
+ * Copyright (C) 2023-2025 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "jsonarena.h"
+#include "cJSON.h"
+#include <algorithm>
+#include <mutex>
+#include <stdlib.h>
+
+#define ARENA_BLOCK_SIZE   (64*1024)
+#define ARENA_MAX_RETAINED (4*1024*1024) // Don't hold onto more than this between messages
+#define ARENA_ALIGNMENT    alignof(max_align_t)
+
+static thread_local JSONArena *active_arena = nullptr;
+
+// .-------------------------------------------------------
+// | cJSON hooks
+// '-------------------------------------------------------
+
+static void *arena_malloc(size_t size) {
+    if(active_arena)
+        return active_arena->allocate(size);
+    return malloc(size);
+}
+
+static void arena_free(void *ptr) {
+    // Memory from the arena is released all at once, but anything allocated while no arena was active still needs freeing
+    if(active_arena && active_arena->owns(ptr))
+        return;
+    free(ptr);
+}
+
+static void install_hooks() {
+    static std::once_flag installed;
+    std::call_once(installed, []() {
+        cJSON_Hooks hooks = {arena_malloc, arena_free};
+        cJSON_InitHooks(&hooks);
+    });
+}
+
+// .-------------------------------------------------------
+// | Arena
+// '-------------------------------------------------------
+
+JSONArena::JSONArena() {
+    install_hooks();
+}
+
+JSONArena::~JSONArena() {
+    for(Block &block : this->blocks)
+        free(block.memory);
+}
+
+void JSONArena::add_block(size_t minimum_size) {
+    Block block;
+    block.size = std::max(minimum_size, (size_t)ARENA_BLOCK_SIZE);
+    block.memory = (char*)malloc(block.size);
+    block.used = 0;
+    this->blocks.push_back(block);
+}
+
+void *JSONArena::allocate(size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    if(this->blocks.empty() || this->blocks.back().size - this->blocks.back().used < size) {
+        // Grow geometrically so a big message doesn't need many blocks
+        size_t next_size = this->blocks.empty() ? 0 : this->blocks.back().size * 2;
+        this->add_block(std::max(size, next_size));
+        if(!this->blocks.back().memory) {
+            this->blocks.pop_back();
+            return nullptr;
+        }
+    }
+    Block &block = this->blocks.back();
+    void *ptr = block.memory + block.used;
+    block.used += size;
+    return ptr;
+}
+
+bool JSONArena::owns(const void *ptr) const {
+    const char *p = (const char*)ptr;
+    for(const Block &block : this->blocks) {
+        if(p >= block.memory && p < block.memory + block.size)
+            return true;
+    }
+    return false;
+}
+
+void JSONArena::reset() {
+    if(this->blocks.size() > 1) {
+        // Replace the blocks with a single one big enough for what was just used, so the next message of this size needs one block
+        size_t total = 0;
+        for(Block &block : this->blocks) {
+            total += block.used;
+            free(block.memory);
+        }
+        this->blocks.clear();
+        this->add_block(std::min(total, (size_t)ARENA_MAX_RETAINED));
+        if(!this->blocks.back().memory)
+            this->blocks.clear();
+    } else if(!this->blocks.empty()) {
+        if(this->blocks[0].size > ARENA_MAX_RETAINED) {
+            free(this->blocks[0].memory);
+            this->blocks.clear();
+        } else {
+            this->blocks[0].used = 0;
+        }
+    }
+}
+
+// .-------------------------------------------------------
+// | Scope
+// '-------------------------------------------------------
+
+JSONArenaScope::JSONArenaScope(JSONArena &arena) {
+    this->arena = &arena;
+    this->previous = active_arena;
+    active_arena = &arena;
+}
+
+JSONArenaScope::~JSONArenaScope() {
+    active_arena = this->previous;
+    // An outer scope for the same arena may still be using what's in it
+    if(this->previous != this->arena)
+        this->arena->reset();
+}
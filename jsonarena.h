@@ -0,0 +1,61 @@
+/*
+ * Tilemap Town native client
+ *
+ * Copyright (C) 2023-2025 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef JSONARENA_H
+#define JSONARENA_H
+
+#include <vector>
+#include <stddef.h>
+
+// Bump allocator for cJSON. While a JSONArenaScope is active on a thread, everything cJSON allocates on
+// that thread comes out of the arena and freeing it does nothing; the whole arena is released at once with reset().
+class JSONArena {
+public:
+    JSONArena();
+    ~JSONArena();
+    JSONArena(const JSONArena&) = delete;
+    JSONArena &operator=(const JSONArena&) = delete;
+
+    void *allocate(size_t size);
+    bool owns(const void *ptr) const;
+    void reset();
+
+private:
+    struct Block {
+        char *memory;
+        size_t size;
+        size_t used;
+    };
+    std::vector<Block> blocks;
+
+    void add_block(size_t minimum_size);
+};
+
+// Routes cJSON's allocations on this thread to 'arena' until the scope ends, then resets the arena
+// unless an outer scope is using the same one.
+class JSONArenaScope {
+public:
+    JSONArenaScope(JSONArena &arena);
+    ~JSONArenaScope();
+
+private:
+    JSONArena *arena;
+    JSONArena *previous;
+};
+
+#endif // JSONARENA_H
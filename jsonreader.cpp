@@ -0,0 +1,447 @@
+/*
+ * Tilemap Town native client
+ *
+ * Copyright (C) 2023-2025 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "jsonreader.h"
+#include "cJSON.h"
+#include <charconv>
+#include <limits.h>
+#include <string.h>
+
+JSONReader::JSONReader(const char *text, size_t length) {
+    this->text = text;
+    this->end = text + length;
+    this->at = text;
+    this->error = false;
+    this->first_in_container = false;
+    this->container_depth = 0;
+    this->container_is_object = 0;
+}
+
+bool JSONReader::fail() {
+    this->error = true;
+    return false;
+}
+
+void JSONReader::skip_whitespace() {
+    while(this->at < this->end && (*this->at == ' ' || *this->at == '\n' || *this->at == '\r' || *this->at == '\t'))
+        this->at++;
+}
+
+void JSONReader::seek(size_t position) {
+    this->at = this->text + position;
+    this->first_in_container = false;
+}
+
+JSONType JSONReader::peek() {
+    if(this->error)
+        return JSON_INVALID;
+    this->skip_whitespace();
+    if(this->at >= this->end)
+        return JSON_INVALID;
+    switch(*this->at) {
+    case '{':
+        return JSON_OBJECT;
+    case '[':
+        return JSON_ARRAY;
+    case '"':
+        return JSON_STRING;
+    case 't':
+        return JSON_TRUE;
+    case 'f':
+        return JSON_FALSE;
+    case 'n':
+        return JSON_NULL;
+    case '-':
+        return JSON_NUMBER;
+    default:
+        if(*this->at >= '0' && *this->at <= '9')
+            return JSON_NUMBER;
+        return JSON_INVALID;
+    }
+}
+
+// .-------------------------------------------------------
+// | Containers
+// '-------------------------------------------------------
+
+bool JSONReader::enter_object() {
+    if(this->peek() != JSON_OBJECT) {
+        this->skip_value();
+        return false;
+    }
+    this->at++;
+    this->first_in_container = true;
+    this->container_depth++;
+    this->container_is_object = (this->container_is_object << 1) | 1;
+    return true;
+}
+
+bool JSONReader::enter_array() {
+    if(this->peek() != JSON_ARRAY) {
+        this->skip_value();
+        return false;
+    }
+    this->at++;
+    this->first_in_container = true;
+    this->container_depth++;
+    this->container_is_object <<= 1;
+    return true;
+}
+
+bool JSONReader::next_key(std::string_view &key) {
+    if(this->error)
+        return false;
+    this->skip_whitespace();
+    if(this->at >= this->end)
+        return this->fail();
+    if(*this->at == '}') {
+        this->at++;
+        this->first_in_container = false;
+        this->container_depth--;
+        this->container_is_object >>= 1;
+        return false;
+    }
+    if(!this->first_in_container) {
+        if(*this->at != ',')
+            return this->fail();
+        this->at++;
+        this->skip_whitespace();
+    }
+    this->first_in_container = false;
+
+    // Keys are returned as-is, without processing escapes
+    if(this->at >= this->end || *this->at != '"')
+        return this->fail();
+    const char *start = this->at + 1;
+    if(!this->skip_string())
+        return false;
+    key = std::string_view(start, this->at - 1 - start);
+
+    this->skip_whitespace();
+    if(this->at >= this->end || *this->at != ':')
+        return this->fail();
+    this->at++;
+    return true;
+}
+
+bool JSONReader::next_item() {
+    if(this->error)
+        return false;
+    this->skip_whitespace();
+    if(this->at >= this->end)
+        return this->fail();
+    if(*this->at == ']') {
+        this->at++;
+        this->first_in_container = false;
+        this->container_depth--;
+        this->container_is_object >>= 1;
+        return false;
+    }
+    if(!this->first_in_container) {
+        if(*this->at != ',')
+            return this->fail();
+        this->at++;
+    }
+    this->first_in_container = false;
+    return true;
+}
+
+bool JSONReader::leave(size_t depth) {
+    while(this->container_depth > depth && !this->error) {
+        if(this->container_is_object & 1) {
+            std::string_view key;
+            while(this->next_key(key))
+                this->skip_value();
+        } else {
+            while(this->next_item())
+                this->skip_value();
+        }
+    }
+    return !this->error;
+}
+
+// .-------------------------------------------------------
+// | Values
+// '-------------------------------------------------------
+
+bool JSONReader::skip_string() {
+    // Assumes 'at' is on the opening quote, and leaves it after the closing quote
+    this->at++;
+    while(this->at < this->end) {
+        const char *found = (const char*)memchr(this->at, '"', this->end - this->at);
+        if(!found)
+            break;
+        // Make sure the quote isn't escaped
+        const char *backslash = found;
+        while(backslash > this->at && backslash[-1] == '\\')
+            backslash--;
+        this->at = found + 1;
+        if((found - backslash) % 2 == 0)
+            return true;
+    }
+    return this->fail();
+}
+
+bool JSONReader::read_number(double &out, bool &is_integer, long long &integer) {
+    const char *start = this->at;
+    bool negative = false;
+    if(this->at < this->end && *this->at == '-') {
+        negative = true;
+        this->at++;
+    }
+    if(this->at >= this->end || *this->at < '0' || *this->at > '9')
+        return this->fail();
+
+    integer = 0;
+    int digits = 0;
+    while(this->at < this->end && *this->at >= '0' && *this->at <= '9') {
+        if(digits < 18)
+            integer = integer * 10 + (*this->at - '0');
+        this->at++;
+        digits++;
+    }
+    is_integer = digits <= 18;
+    if(this->at < this->end && (*this->at == '.' || *this->at == 'e' || *this->at == 'E')) {
+        is_integer = false;
+        this->at++;
+        while(this->at < this->end && ((*this->at >= '0' && *this->at <= '9') || *this->at == '.' || *this->at == 'e' || *this->at == 'E' || *this->at == '+' || *this->at == '-'))
+            this->at++;
+    }
+
+    if(is_integer) {
+        if(negative)
+            integer = -integer;
+        out = (double)integer;
+        return true;
+    }
+    if(std::from_chars(start, this->at, out).ec != std::errc())
+        return this->fail();
+    return true;
+}
+
+bool JSONReader::skip_value() {
+    switch(this->peek()) {
+    case JSON_OBJECT:
+    case JSON_ARRAY:
+    {
+        int depth = 0;
+        while(this->at < this->end) {
+            char c = *this->at;
+            if(c == '"') {
+                if(!this->skip_string())
+                    return false;
+                continue;
+            }
+            this->at++;
+            if(c == '{' || c == '[') {
+                depth++;
+            } else if(c == '}' || c == ']') {
+                if(--depth == 0)
+                    return true;
+            }
+        }
+        return this->fail();
+    }
+    case JSON_STRING:
+        return this->skip_string();
+    case JSON_NUMBER:
+    {
+        double number;
+        bool is_integer;
+        long long integer;
+        return this->read_number(number, is_integer, integer);
+    }
+    case JSON_TRUE:
+    case JSON_NULL:
+        if(this->end - this->at < 4)
+            return this->fail();
+        this->at += 4;
+        return true;
+    case JSON_FALSE:
+        if(this->end - this->at < 5)
+            return this->fail();
+        this->at += 5;
+        return true;
+    default:
+        return this->fail();
+    }
+}
+
+bool JSONReader::read_int(int &out) {
+    if(this->peek() != JSON_NUMBER) {
+        this->skip_value();
+        return false;
+    }
+    double number;
+    bool is_integer;
+    long long integer;
+    if(!this->read_number(number, is_integer, integer))
+        return false;
+
+    // Same conversion as cJSON's valueint
+    if(is_integer && integer >= INT_MIN && integer <= INT_MAX)
+        out = (int)integer;
+    else if(number >= INT_MAX)
+        out = INT_MAX;
+    else if(number <= (double)INT_MIN)
+        out = INT_MIN;
+    else
+        out = (int)number;
+    return true;
+}
+
+static int parse_hex4(const char *p) {
+    int value = 0;
+    for(int i=0; i<4; i++) {
+        char c = p[i];
+        value <<= 4;
+        if(c >= '0' && c <= '9')
+            value |= c - '0';
+        else if(c >= 'a' && c <= 'f')
+            value |= c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F')
+            value |= c - 'A' + 10;
+        else
+            return -1;
+    }
+    return value;
+}
+
+static void append_utf8(std::string &out, unsigned int code) {
+    if(code < 0x80) {
+        out.push_back(code);
+    } else if(code < 0x800) {
+        out.push_back(0xC0 | (code >> 6));
+        out.push_back(0x80 | (code & 0x3F));
+    } else if(code < 0x10000) {
+        out.push_back(0xE0 | (code >> 12));
+        out.push_back(0x80 | ((code >> 6) & 0x3F));
+        out.push_back(0x80 | (code & 0x3F));
+    } else {
+        out.push_back(0xF0 | (code >> 18));
+        out.push_back(0x80 | ((code >> 12) & 0x3F));
+        out.push_back(0x80 | ((code >> 6) & 0x3F));
+        out.push_back(0x80 | (code & 0x3F));
+    }
+}
+
+bool JSONReader::read_string(std::string &out) {
+    if(this->peek() != JSON_STRING) {
+        this->skip_value();
+        return false;
+    }
+    this->at++;
+    out.clear();
+    while(1) {
+        // Copy everything up to the next quote or escape at once
+        const char *run = this->at;
+        while(this->at < this->end && *this->at != '"' && *this->at != '\\')
+            this->at++;
+        out.append(run, this->at - run);
+        if(this->at >= this->end)
+            return this->fail();
+        if(*this->at == '"') {
+            this->at++;
+            return true;
+        }
+
+        this->at++; // Skip the backslash
+        if(this->at >= this->end)
+            return this->fail();
+        char c = *this->at++;
+        switch(c) {
+        case 'b': out.push_back('\b'); break;
+        case 'f': out.push_back('\f'); break;
+        case 'n': out.push_back('\n'); break;
+        case 'r': out.push_back('\r'); break;
+        case 't': out.push_back('\t'); break;
+        case 'u':
+        {
+            if(this->end - this->at < 4)
+                return this->fail();
+            int code = parse_hex4(this->at);
+            if(code < 0)
+                return this->fail();
+            this->at += 4;
+            // Combine surrogate pairs
+            if(code >= 0xD800 && code <= 0xDBFF && this->end - this->at >= 6 && this->at[0] == '\\' && this->at[1] == 'u') {
+                int low = parse_hex4(this->at + 2);
+                if(low >= 0xDC00 && low <= 0xDFFF) {
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    this->at += 6;
+                }
+            }
+            append_utf8(out, code);
+            break;
+        }
+        default:
+            out.push_back(c);
+            break;
+        }
+    }
+}
+
+bool JSONReader::read_string_or_int(std::string &out) {
+    switch(this->peek()) {
+    case JSON_STRING:
+        return this->read_string(out);
+    case JSON_NUMBER:
+    {
+        int value;
+        if(!this->read_int(value))
+            return false;
+        out = std::to_string(value);
+        return true;
+    }
+    default:
+        this->skip_value();
+        return false;
+    }
+}
+
+bool JSONReader::read_int_array(int count, int *out) {
+    size_t depth = this->container_depth;
+    if(!this->enter_array())
+        return false;
+    for(int i=0; i<count; i++) {
+        if(!this->next_item() || !this->read_int(out[i])) {
+            this->leave(depth);
+            return false;
+        }
+    }
+    if(this->next_item()) {
+        this->leave(depth);
+        return false;
+    }
+    return !this->error;
+}
+
+bool JSONReader::read_is_true() {
+    bool is_true = this->peek() == JSON_TRUE;
+    this->skip_value();
+    return is_true && !this->error;
+}
+
+cJSON *JSONReader::read_cjson() {
+    if(this->peek() == JSON_INVALID)
+        return nullptr;
+    const char *start = this->at;
+    if(!this->skip_value())
+        return nullptr;
+    return cJSON_ParseWithLength(start, this->at - start);
+}
@@ -0,0 +1,82 @@
+/*
+ * Tilemap Town native client
+ *
+ * Copyright (C) 2023-2025 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef JSONREADER_H
+#define JSONREADER_H
+
+#include <string>
+#include <string_view>
+#include <stddef.h>
+#include <stdint.h>
+
+struct cJSON;
+
+enum JSONType {
+    JSON_INVALID,
+    JSON_OBJECT,
+    JSON_ARRAY,
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_TRUE,
+    JSON_FALSE,
+    JSON_NULL,
+};
+
+// Reads JSON one value at a time, directly out of the message text, without building a tree.
+// Every read_ function consumes the next value even if it's the wrong type, and returns false in that case.
+// Once the text turns out to be malformed, everything returns false and failed() is true.
+class JSONReader {
+public:
+    JSONReader(const char *text, size_t length);
+
+    JSONType peek();
+    bool failed() const { return this->error; }
+    size_t position() const { return this->at - this->text; }
+    void seek(size_t position);
+
+    // Containers
+    bool enter_object();                  // Consumes the {
+    bool next_key(std::string_view &key); // Reads "key": and returns true, or consumes the } and returns false
+    bool enter_array();                   // Consumes the [
+    bool next_item();                     // Returns true if there's another item, or consumes the ] and returns false
+    size_t depth() const { return this->container_depth; }
+    bool leave(size_t depth);             // Skips the rest of every container entered since depth() was 'depth'
+
+    // Values
+    bool skip_value();
+    bool read_int(int &out);
+    bool read_string(std::string &out);
+    bool read_string_or_int(std::string &out); // Numbers are converted to strings
+    bool read_int_array(int count, int *out);  // Array must be exactly 'count' numbers long
+    bool read_is_true();                       // True if the value was 'true'
+    cJSON *read_cjson();                       // Parses the next value with cJSON; caller deletes it
+
+private:
+    const char *text, *end, *at;
+    bool error;
+    bool first_in_container;
+    size_t container_depth;
+    uint64_t container_is_object; // One bit per level, for the 64 innermost containers entered
+
+    void skip_whitespace();
+    bool fail();
+    bool skip_string();
+    bool read_number(double &out, bool &is_integer, long long &integer);
+};
+
+#endif // JSONREADER_H
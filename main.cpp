@@ -1,11 +1,22 @@
 #include "mainwindow.h"
 
 #include <QApplication>
+#include <QCommandLineParser>
+#include <QDebug>
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption recordOption("record", "Write every message from the server to <file>, for TilemapTownReplay.", "file");
+    parser.addOption(recordOption);
+    parser.process(a);
+
     MainWindow w;
+    if (parser.isSet(recordOption) && !w.tilemapTownClient.session_recorder.open(parser.value(recordOption).toLocal8Bit().constData()))
+        qWarning() << "Can't open" << parser.value(recordOption) << "for recording";
     w.show();
     return a.exec();
 }
@@ -1,4 +1,5 @@
 #include <QDesktopServices>
+#include <QActionGroup>
 #include <ctime>
 #include <iomanip>
 #include "mainwindow.h"
@@ -14,6 +15,7 @@ MainWindow::MainWindow(QWidget *parent)
     connect(&this->tilemapTownClient, &TilemapTownClient::request_draw, this, &MainWindow::want_redraw);
     connect(&this->townFileCache,     &TownFileCache::request_redraw, this, &MainWindow::want_redraw);
     this->tilemapTownClient.http = &this->townFileCache;
+    this->townFileCache.client = &this->tilemapTownClient;
 
     // Set up tabs and UI
     ui->setupUi(this);
@@ -22,6 +24,12 @@ MainWindow::MainWindow(QWidget *parent)
     //int tabFocus = ui->tabChatChannels->addTab("Focus");
     ui->tabChatChannels->setTabsClosable(true);
 
+    QActionGroup *frameRateGroup = new QActionGroup(this);
+    frameRateGroup->addAction(ui->actionFrame_rate_60);
+    frameRateGroup->addAction(ui->actionFrame_rate_30);
+    frameRateGroup->addAction(ui->actionFrame_rate_15);
+    frameRateGroup->addAction(ui->actionFrame_rate_on_demand);
+
     // Initialize server settings
     this->websocket_server = "wss://tilemap.town/ws/:443";
     this->town_nickname = "qt";
@@ -96,9 +104,41 @@ void MainWindow::on_actionWalk_through_walls_triggered()
     this->tilemapTownClient.walk_through_walls = this->ui->actionWalk_through_walls->isChecked();
 }
 
+void MainWindow::on_actionFrame_rate_60_triggered()
+{
+    this->ui->tilemapTownMapView->setFrameRateCap(60);
+}
+
+void MainWindow::on_actionFrame_rate_30_triggered()
+{
+    this->ui->tilemapTownMapView->setFrameRateCap(30);
+}
+
+void MainWindow::on_actionFrame_rate_15_triggered()
+{
+    this->ui->tilemapTownMapView->setFrameRateCap(15);
+}
+
+void MainWindow::on_actionFrame_rate_on_demand_triggered()
+{
+    this->ui->tilemapTownMapView->setFrameRateCap(0);
+}
+
+void MainWindow::on_actionMap_tile_animation_triggered()
+{
+    this->ui->tilemapTownMapView->setTileAnimation(this->ui->actionMap_tile_animation->isChecked());
+}
+
+void MainWindow::on_actionDebug_info_triggered()
+{
+    TilemapTownMapView *view = this->ui->tilemapTownMapView;
+    this->logMessage(std::format("<span style=\"color:silver;\">Repaints requested: {}, frames painted: {}</span>",
+        view->invalidationsReceived, view->framesPainted), "debug");
+}
+
 void MainWindow::want_redraw()
 {
-    this->ui->tilemapTownMapView->update();
+    this->ui->tilemapTownMapView->updateDirtyAreas();
     this->on_tilemapTownMapView_movedPlayer();
     Entity *me = this->tilemapTownClient.your_entity();
     if (!me)
@@ -33,6 +33,12 @@ private slots:
     void on_actionZoom_in_triggered();
     void on_actionReset_zoom_triggered();
     void on_actionWalk_through_walls_triggered();
+    void on_actionFrame_rate_60_triggered();
+    void on_actionFrame_rate_30_triggered();
+    void on_actionFrame_rate_15_triggered();
+    void on_actionFrame_rate_on_demand_triggered();
+    void on_actionMap_tile_animation_triggered();
+    void on_actionDebug_info_triggered();
     void on_tilemapTownMapView_focusChat();
     void on_tilemapTownMapView_movedPlayer();
     void on_textInput_returnPressed();
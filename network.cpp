@@ -18,6 +18,11 @@
  */
 #include "town.h"
 #include <stdlib.h>
+#ifdef USING_QT
+#include <QDebug>
+#include <QStringEncoder>
+#include <QtWebSockets/QWebSocket>
+#endif
 
 #ifdef __3DS__
 #include <3ds.h>
@@ -100,49 +105,109 @@ void network_finish() {
 // ----------------------------------------------
 
 #ifdef USING_QT
-int TilemapTownClient::websocket_connect(std::string server) {
-    this->map_received = false;
-    connect(&this->websocket, &QWebSocket::connected, this, &TilemapTownClient::onWebSocketConnected, Qt::UniqueConnection);
-    connect(&this->websocket, &QWebSocket::disconnected, this, &TilemapTownClient::onWebSocketDisconnected, Qt::UniqueConnection);
-    connect(&this->websocket, &QWebSocket::errorOccurred, this, &TilemapTownClient::onWebSocketError, Qt::UniqueConnection);
-    connect(&this->websocket, QOverload<const QList<QSslError>&>::of(&QWebSocket::sslErrors),
-            this, &TilemapTownClient::onWebSocketSslErrors, Qt::UniqueConnection);
-    connect(&this->websocket, &QWebSocket::textMessageReceived,
-            this, &TilemapTownClient::onWebSocketTextMessageReceived, Qt::UniqueConnection);
-
-    this->websocket.open(QString::fromUtf8(server));
-    return 1;
-}
+// Owns the websocket on TilemapTownClient::network_thread. Messages are converted, recorded and decoded there,
+// so the client's thread only has to apply them, and a big MAP or BAT doesn't hold up input and painting.
+class NetworkWorker : public QObject {
+public:
+    NetworkWorker(TilemapTownClient *client) : client(client) {}
+
+    void open(const QString &url) {
+        if(!this->websocket) {
+            this->websocket = new QWebSocket(QString(), QWebSocketProtocol::VersionLatest, this);
+            TilemapTownClient *client = this->client;
+            connect(this->websocket, &QWebSocket::connected, this, [client]() {
+                QMetaObject::invokeMethod(client, [client]() { client->onWebSocketConnected(); });
+            });
+            connect(this->websocket, &QWebSocket::disconnected, this, [client]() {
+                QMetaObject::invokeMethod(client, [client]() { client->onWebSocketDisconnected(); });
+            });
+            connect(this->websocket, &QWebSocket::errorOccurred, this, [client](QAbstractSocket::SocketError error) {
+                qWarning() << "Websocket error:" << error;
+                QMetaObject::invokeMethod(client, [client]() { client->log_message("Websocket error", ""); });
+            });
+            connect(this->websocket, QOverload<const QList<QSslError>&>::of(&QWebSocket::sslErrors), this, [client](const QList<QSslError> &errors) {
+                qWarning() << "SSL errors:" << errors;
+                QMetaObject::invokeMethod(client, [client]() { client->log_message("SSL error", ""); });
+            });
+            connect(this->websocket, &QWebSocket::textMessageReceived, this, &NetworkWorker::text_message_received);
+            connect(this->websocket, &QWebSocket::binaryMessageReceived, this, &NetworkWorker::binary_message_received);
+        }
+        this->websocket->open(url);
+    }
 
-void TilemapTownClient::websocket_disconnect() {
-    this->websocket.close();
-}
+    void close() {
+        if(this->websocket)
+            this->websocket->close();
+    }
 
-void TilemapTownClient::onWebSocketConnected() {
-    log_message("Connected to server", "");
-    this->connected = true;
-    this->connected_to_server();
-}
+    void send(const QString &text) {
+        if(this->websocket)
+            this->websocket->sendTextMessage(text);
+    }
 
-void TilemapTownClient::onWebSocketDisconnected() {
-    this->connected = false;
-    log_message("Disconnected from server", "");
-}
+private:
+    TilemapTownClient *client;
+    QWebSocket *websocket = nullptr;
+    QStringEncoder utf8_encoder{QStringEncoder::Utf8};
+    QByteArray text_message_buffer; // Reused for converting text frames to UTF-8
+
+    void text_message_received(const QString &message) {
+        // QWebSocket has already decoded text frames to UTF-16, so they need converting back.
+        // Encode into a buffer that's kept between messages instead of allocating a new one each time.
+        qsizetype needed = this->utf8_encoder.requiredSpace(message.size());
+        if(this->text_message_buffer.size() < needed)
+            this->text_message_buffer.resize(needed);
+        char *start = this->text_message_buffer.data();
+        char *end = this->utf8_encoder.appendToBuffer(start, message);
+        this->received(start, end - start);
+    }
 
-void TilemapTownClient::onWebSocketError(QAbstractSocket::SocketError error) {
-    qWarning() << "Websocket error:" << error;
-    log_message("Websocket error", "");
-}
+    void binary_message_received(const QByteArray &message) {
+        this->received(message.constData(), message.size());
+    }
 
-void TilemapTownClient::onWebSocketTextMessageReceived(QString message) {
-    QByteArray bytes = message.toUtf8();
-    this->websocket_message(bytes, bytes.size());
+    void received(const char *text, size_t length) {
+        this->client->session_recorder.write(text, length);
+        auto message = std::make_unique<DecodedMessage>();
+        decode_message(text, length, *message);
+
+        // If the client has fallen this far behind, wait for it rather than using more and more memory
+        while(!this->client->decoded_messages.push(message)) {
+            if(QThread::currentThread()->isInterruptionRequested())
+                return;
+            QThread::msleep(1);
+        }
+        if(!this->client->apply_scheduled.exchange(true)) {
+            TilemapTownClient *client = this->client;
+            QMetaObject::invokeMethod(client, [client]() { client->apply_decoded_messages(); });
+        }
+    }
+};
+
+int TilemapTownClient::websocket_connect(std::string server) {
+    this->map_received = false;
+    if(!this->network_worker) {
+        this->network_worker = new NetworkWorker(this);
+        this->network_worker->moveToThread(&this->network_thread);
+        connect(&this->network_thread, &QThread::finished, this->network_worker, &QObject::deleteLater);
+        this->network_thread.start();
+
+        NetworkWorker *worker = this->network_worker;
+        this->send_text = [worker](const std::string &text) {
+            QMetaObject::invokeMethod(worker, [worker, text = QString::fromUtf8(text)]() { worker->send(text); });
+        };
+    }
+
+    NetworkWorker *worker = this->network_worker;
+    QMetaObject::invokeMethod(worker, [worker, url = QString::fromUtf8(server)]() { worker->open(url); });
+    return 1;
 }
 
-void TilemapTownClient::onWebSocketSslErrors(const QList<QSslError> &errors) {
-    qWarning() << "SSL errors:" << errors;
-    log_message("SSL error", "");
+void TilemapTownClient::websocket_disconnect() {
+    if(NetworkWorker *worker = this->network_worker)
+        QMetaObject::invokeMethod(worker, [worker]() { worker->close(); });
 }
+
 #else
 // Login details
 extern char login_username[256];
@@ -463,11 +528,7 @@ void HttpFileCache::get(std::string url, void (*callback) (const char *url, uint
 // - Websockets
 // ----------------------------------------------
 
-#ifdef USING_QT
-void TilemapTownClient::websocket_write(std::string text) {
-    this->websocket.sendTextMessage(QString::fromUtf8(text));
-}
-#else
+#ifndef USING_QT
 ssize_t wslay_recv(wslay_event_context_ptr ctx, uint8_t *data, size_t len, int flags, void *user_data) {
     TilemapTownClient *client = (TilemapTownClient*)user_data;
 
@@ -509,6 +570,7 @@ int wslay_genmask(wslay_event_context_ptr ctx, uint8_t *buf, size_t len, void *u
 void wslay_message(wslay_event_context_ptr ctx, const struct wslay_event_on_msg_recv_arg *arg, void *user_data) {
     TilemapTownClient *client = (TilemapTownClient*)user_data;
     if(arg->opcode == WSLAY_TEXT_FRAME) {
+        client->session_recorder.write((const char*)arg->msg, arg->msg_length);
         client->websocket_message((const char*)arg->msg, arg->msg_length);
     } else if(arg->opcode == WSLAY_CONNECTION_CLOSE) {
         puts("\x1b[31mConnection closed\x1b[0m\nPress A to continue");
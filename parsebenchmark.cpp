@@ -0,0 +1,81 @@
+/*
+ * Tilemap Town native client
+ *
+ * Copyright (C) 2023-2025 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares how long recorded messages take to process with the cJSON parser and with the streaming parser.
+// Usage: TilemapTownParseBenchmark [-n iterations] message_file...
+// Each file holds one message exactly as the server sent it, such as "MAP {...}". The files are processed
+// in the order given, so a MAP should come after the MAI that sets the map size.
+
+#include "town.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <vector>
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+
+    int iterations = 20;
+    std::vector<std::string> names;
+    std::vector<QByteArray> messages;
+    for(int i=1; i<argc; i++) {
+        if(!strcmp(argv[i], "-n") && i+1 < argc) {
+            iterations = std::max(atoi(argv[++i]), 1);
+            continue;
+        }
+        QFile file(QString::fromUtf8(argv[i]));
+        if(!file.open(QIODevice::ReadOnly)) {
+            fprintf(stderr, "Can't open %s\n", argv[i]);
+            return 1;
+        }
+        names.push_back(argv[i]);
+        messages.push_back(file.readAll());
+    }
+    if(messages.empty()) {
+        fprintf(stderr, "Usage: %s [-n iterations] message_file...\n", argv[0]);
+        return 1;
+    }
+
+    // Total nanoseconds spent on each message, for each parser
+    std::vector<qint64> time_taken[2];
+    for(int streaming = 0; streaming < 2; streaming++) {
+        time_taken[streaming].assign(messages.size(), 0);
+
+        TilemapTownClient client;
+        client.http = nullptr;
+        client.streaming_parser = streaming;
+
+        QElapsedTimer timer;
+        for(int iteration = 0; iteration < iterations; iteration++) {
+            for(size_t i=0; i<messages.size(); i++) {
+                timer.start();
+                client.websocket_message(messages[i].constData(), messages[i].size());
+                time_taken[streaming][i] += timer.nsecsElapsed();
+            }
+        }
+    }
+
+    printf("%-32s %10s %12s %12s %8s\n", "message", "bytes", "cJSON us", "streaming us", "speedup");
+    for(size_t i=0; i<messages.size(); i++) {
+        double dom_us = time_taken[0][i] / 1000.0 / iterations;
+        double stream_us = time_taken[1][i] / 1000.0 / iterations;
+        printf("%-32s %10lld %12.1f %12.1f %7.2fx\n", names[i].c_str(), (long long)messages[i].size(), dom_us, stream_us, stream_us > 0 ? dom_us / stream_us : 0.0);
+    }
+    return 0;
+}
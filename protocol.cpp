@@ -18,10 +18,13 @@
  */
 #include "town.h"
 #include "cJSON.h"
+#include "jsonreader.h"
 #include <stdarg.h>
+#include <charconv>
+#include <algorithm>
 #include <format>
 
-#define protocol_command_as_int(a,b,c) (a) | (b<<8) | (c<<16)
+#define protocol_command_as_int(a,b,c) ((a) | (b<<8) | (c<<16))
 
 #define get_json_item cJSON_GetObjectItemCaseSensitive
 
@@ -268,7 +271,7 @@ int map_tile_from_json(cJSON *json, MapTileInfo *out) {
     return 1;
 }
 
-std::string Entity::apply_json(cJSON *json) {
+EntityID Entity::apply_json(cJSON *json, EntityList &list) {
     cJSON *i_name         = get_json_item(json, "name");
     cJSON *i_pic          = get_json_item(json, "pic");
     cJSON *i_x            = get_json_item(json, "x");
@@ -292,10 +295,10 @@ std::string Entity::apply_json(cJSON *json) {
         this->passengers.clear();
         cJSON *passenger;
         cJSON_ArrayForEach(passenger, i_passengers) {
-            this->passengers.insert(json_as_string(passenger));
+            this->passengers.push_back(list.intern_id(json_as_string(passenger)));
         }
     }
-    if(cJSON_IsString(i_vehicle)) this->vehicle_id = json_as_string(i_vehicle);
+    if(cJSON_IsString(i_vehicle)) this->vehicle = list.intern_id(json_as_string(i_vehicle));
     if(i_is_following) this->is_following = cJSON_IsTrue(i_is_following);
     if(i_type)
         ;
@@ -311,49 +314,739 @@ std::string Entity::apply_json(cJSON *json) {
             this->offset_y = 0;
         }
     }
-    if(i_id) return json_as_string(i_id);
-    return "";
+    if(i_id) return list.intern_id(json_as_string(i_id));
+    return 0;
 }
 
-MapTileReference::MapTileReference(cJSON *json, TilemapTownClient *client) {
+EntityID TilemapTownClient::entity_id_from_json(cJSON *json) {
+    // MOV is the most common message, so look the ID up without making a new string each time
     if(cJSON_IsString(json)) {
-        // Attempt to look up the tile in the tilesets the client already has
-        auto it = client->tileset.find(json->valuestring);
-        if(it != client->tileset.end()) {
-            // If it's present, record a pointer to that tile instead of allocating a string
-            this->tile = (*it).second;
-        } else {
-            // If it's not present, hold onto the string until it can be turned into a tile later
-            this->tile = std::string(json->valuestring);
-        }
+        this->entity_id_buffer.assign(json->valuestring);
+    } else if(cJSON_IsNumber(json)) {
+        char digits[16];
+        std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), json->valueint);
+        this->entity_id_buffer.assign(digits, result.ptr);
+    } else {
+        return 0;
+    }
+    return this->who.find_id(this->entity_id_buffer);
+}
+
+MapTileID TilemapTownClient::tile_from_json(cJSON *json) {
+    if(cJSON_IsString(json)) {
+        // The tile may not be defined yet; if so, it'll start showing up when RSC defines it
+        return this->tiles.intern_key(json->valuestring);
     } else if(cJSON_IsObject(json)) {
         MapTileInfo tile_info = MapTileInfo();
         if(map_tile_from_json(json, &tile_info)) {
-            this->tile = client->get_shared_pointer_to_tile(&tile_info);
+            return this->tiles.intern_info(tile_info);
+        }
+    }
+    return 0;
+}
+
+// .-------------------------------------------------------
+// | Streaming versions of the above
+// '-------------------------------------------------------
+
+#define JSON_KEY_NOT_FOUND SIZE_MAX
+
+// Finds where the values for the given keys are in a top-level object, so they can be read in whatever order they're needed in
+static bool find_json_keys(JSONReader &reader, int count, const char *const *names, size_t *positions) {
+    for(int i=0; i<count; i++)
+        positions[i] = JSON_KEY_NOT_FOUND;
+    if(!reader.enter_object())
+        return false;
+    std::string_view key;
+    while(reader.next_key(key)) {
+        for(int i=0; i<count; i++) {
+            if(key == names[i]) {
+                positions[i] = reader.position();
+                break;
+            }
+        }
+        reader.skip_value();
+    }
+    return !reader.failed();
+}
+
+// Returns true if there are keys besides the given ones, which means the message needs the cJSON path
+static bool has_other_json_keys(JSONReader &reader, int count, const char *const *names) {
+    reader.seek(0);
+    if(!reader.enter_object())
+        return true;
+    std::string_view key;
+    while(reader.next_key(key)) {
+        bool found = false;
+        for(int i=0; i<count; i++) {
+            if(key == names[i]) {
+                found = true;
+                break;
+            }
+        }
+        if(!found)
+            return true;
+        reader.skip_value();
+    }
+    return reader.failed();
+}
+
+int pic_from_json(JSONReader &reader, struct Pic *out) {
+    size_t depth = reader.depth();
+    if(!reader.enter_array())
+        return 0;
+    std::string key;
+    int x, y;
+    if(!reader.next_item() || !reader.read_string_or_int(key)
+    || !reader.next_item() || !reader.read_int(x)
+    || !reader.next_item() || !reader.read_int(y)
+    || reader.next_item()) {
+        reader.leave(depth);
+        return 0;
+    }
+    out->key = key;
+    out->x = x;
+    out->y = y;
+    return 1;
+}
+
+// Same as Entity::apply_json, except that IDs are left for DecodedEntity::intern_ids
+static void decode_entity(JSONReader &reader, DecodedEntity &out) {
+    Entity &entity = out.entity;
+    size_t depth = reader.depth();
+    if(!reader.enter_object())
+        return;
+
+    std::string_view key;
+    while(reader.next_key(key)) {
+        if(key == "name") {
+            std::string name;
+            if(reader.read_string(name))
+                entity.name = name;
+        } else if(key == "pic") {
+            pic_from_json(reader, &entity.pic);
+        } else if(key == "x") {
+            reader.read_int(entity.x);
+        } else if(key == "y") {
+            reader.read_int(entity.y);
+        } else if(key == "dir") {
+            int dir;
+            if(reader.read_int(dir))
+                entity.update_direction(dir);
+        } else if(key == "passengers") {
+            size_t passengers_depth = reader.depth();
+            if(reader.enter_array()) {
+                out.passengers.clear();
+                out.has_passengers = true;
+                std::string passenger;
+                while(reader.next_item()) {
+                    if(reader.read_string_or_int(passenger))
+                        out.passengers.push_back(passenger);
+                }
+            }
+            reader.leave(passengers_depth);
+        } else if(key == "vehicle") {
+            if(reader.read_string(out.vehicle))
+                out.has_vehicle = true;
+        } else if(key == "is_following") {
+            entity.is_following = reader.read_is_true();
+        } else if(key == "in_user_list") {
+            entity.in_user_list = reader.read_is_true();
+        } else if(key == "typing") {
+            entity.is_typing = reader.read_is_true();
+        } else if(key == "offset") {
+            int offset[2];
+            if(reader.read_int_array(2, offset)) {
+                entity.offset_x = offset[0];
+                entity.offset_y = offset[1];
+            } else {
+                entity.offset_x = 0;
+                entity.offset_y = 0;
+            }
+        } else if(key == "id") {
+            if(reader.read_string_or_int(out.id))
+                out.has_id = true;
+        } else {
+            reader.skip_value();
+        }
+    }
+    reader.leave(depth);
+}
+
+EntityID DecodedEntity::intern_ids(EntityList &list) {
+    if(this->has_passengers) {
+        this->entity.passengers.clear();
+        for(const std::string &passenger : this->passengers)
+            this->entity.passengers.push_back(list.intern_id(passenger));
+    }
+    if(this->has_vehicle)
+        this->entity.vehicle = list.intern_id(this->vehicle);
+    return this->has_id ? list.intern_id(this->id) : 0;
+}
+
+MapTileID TilemapTownClient::tile_from_json(JSONReader &reader) {
+    switch(reader.peek()) {
+    case JSON_STRING:
+        if(!reader.read_string(this->tile_key_buffer))
+            return 0;
+        return this->tiles.intern_key(this->tile_key_buffer);
+    case JSON_OBJECT:
+    {
+        // Custom tiles are uncommon enough that it's fine to use the cJSON path for them
+        cJSON *json = reader.read_cjson();
+        MapTileID id = this->tile_from_json(json);
+        cJSON_Delete(json);
+        return id;
+    }
+    default:
+        reader.skip_value();
+        return 0;
+    }
+}
+
+// Reads the [x, y, ...] at the start of a cell in MAP or BLK, and leaves the reader on the next item
+static bool read_cell_position(JSONReader &reader, int &x, int &y) {
+    return reader.enter_array()
+        && reader.next_item() && reader.read_int(x)
+        && reader.next_item() && reader.read_int(y)
+        && reader.next_item();
+}
+
+void TilemapTownClient::apply_move(const EntityMove &move) {
+    if(move.id == this->your_id && move.has_from)
+        return;
+    if(this->in_batch) {
+        // Only the combined effect of every MOV for an entity in a batch is needed
+        auto it = this->batch_moves.find(move.id);
+        if(it == this->batch_moves.end())
+            this->batch_moves.emplace(move.id, move);
+        else
+            (*it).second.merge(move);
+        return;
+    }
+    this->move_entity(move);
+}
+
+void TilemapTownClient::move_entity(const EntityMove &move) {
+    // Find this entity
+    Entity *entity = this->who.find(move.id);
+    if(entity) {
+        this->mark_dirty(entity->map_rect());
+
+        if(move.has_to) {
+            int old_x = entity->x;
+            int old_y = entity->y;
+            entity->x = move.to_x;
+            entity->y = move.to_y;
+            this->entity_moved(entity);
+            entity->start_walk(old_x, old_y);
+            if(!entity->vehicle || entity->is_following) {
+                entity->walk_timer = 30+1; // 30*(16.6666ms/1000) = 0.5
+            }
+            this->entity_started_moving(entity);
+        }
+
+        if(move.has_offset) {
+            entity->offset_x = move.offset_x;
+            entity->offset_y = move.offset_y;
+            this->entity_moved(entity);
+        }
+
+        if(move.has_dir_lr)
+            entity->update_direction(move.dir_lr);
+        if(move.has_dir_4)
+            entity->update_direction(move.dir_4);
+        if(move.has_dir)
+            entity->update_direction(move.dir);
+        this->mark_dirty(entity->map_rect());
+    }
+    this->need_redraw = true;
+}
+
+// True if 'later' writes to the same layer over every cell 'earlier' does
+static bool fill_covers(const MapFill &later, const MapFill &earlier) {
+    return later.obj == earlier.obj && earlier.x >= later.x && earlier.y >= later.y
+        && (long long)earlier.x + earlier.width <= (long long)later.x + later.width
+        && (long long)earlier.y + earlier.height <= (long long)later.y + later.height;
+}
+
+void TilemapTownClient::fill_turf(int x, int y, int width, int height, MapTileID tile) {
+    MapFill fill = {false, x, y, width, height, tile, 0, 0};
+    if(this->in_batch) {
+        // Earlier fills that this one completely covers no longer matter
+        for(MapFill &earlier : this->batch_fills) {
+            if(fill_covers(fill, earlier))
+                earlier.width = 0;
+        }
+        this->batch_fills.push_back(fill);
+        return;
+    }
+    this->write_fill(fill, nullptr);
+}
+
+void TilemapTownClient::fill_objs(int x, int y, int width, int height, const MapTileID *objs, int count) {
+    MapFill fill = {true, x, y, width, height, 0, 0, (uint16_t)count};
+    if(this->in_batch) {
+        for(MapFill &earlier : this->batch_fills) {
+            if(fill_covers(fill, earlier))
+                earlier.width = 0;
+        }
+        fill.obj_start = this->batch_fill_objs.size();
+        this->batch_fill_objs.insert(this->batch_fill_objs.end(), objs, objs + count);
+        this->batch_fills.push_back(fill);
+        return;
+    }
+    this->write_fill(fill, objs);
+}
+
+void TilemapTownClient::write_fill(const MapFill &fill, const MapTileID *objs) {
+    TownMap *map = &this->town_map;
+
+    // Clip the rectangle to the map, then fill it in one row at a time
+    int x1 = std::max(fill.x, 0);
+    int y1 = std::max(fill.y, 0);
+    int x2 = (int)std::min((long long)fill.x + fill.width - 1, (long long)map->width - 1);
+    int y2 = (int)std::min((long long)fill.y + fill.height - 1, (long long)map->height - 1);
+    if(x1 > x2 || y1 > y2)
+        return;
+    for(int map_y = y1; map_y <= y2; map_y++) {
+        if(fill.obj) {
+            for(int map_x = x1; map_x <= x2; map_x++) {
+                map->set_objs(map_y * map->width + map_x, objs, fill.obj_count);
+            }
+        } else {
+            std::fill(map->turf.begin() + map_y * map->width + x1, map->turf.begin() + map_y * map->width + x2 + 1, fill.turf);
+        }
+    }
+    this->map_cells_changed(x1, y1, x2, y2);
+}
+
+// .-------------------------------------------------------
+// | Decoding separately from applying
+// '-------------------------------------------------------
+
+// Tiles are kept as their JSON text, so that each different tile only has to be interned once when the cells are applied
+static uint32_t decode_tile(JSONReader &reader, const char *text, DecodedCells &cells, std::unordered_map<std::string_view, uint32_t> &tile_numbers) {
+    size_t start = reader.position();
+    if(!reader.skip_value())
+        return 0;
+    std::string_view json(text + start, reader.position() - start);
+    auto [it, added] = tile_numbers.try_emplace(json, cells.tiles.size());
+    if(added)
+        cells.tiles.emplace_back(json);
+    return it->second;
+}
+
+// Reads [x, y, tile], optionally followed by width and height, like the streaming BLK and MAP code
+static bool decode_turf_list(JSONReader &reader, const char *text, DecodedCells &cells, std::unordered_map<std::string_view, uint32_t> &tile_numbers, bool can_have_size) {
+    if(!reader.enter_array())
+        return false;
+    while(reader.next_item()) {
+        size_t depth = reader.depth();
+        DecodedCells::Turf turf = {0, 0, 1, 1, 0};
+        if(read_cell_position(reader, turf.x, turf.y)) {
+            turf.tile = decode_tile(reader, text, cells, tile_numbers);
+            if(!can_have_size || !reader.next_item() || (reader.read_int(turf.width) && reader.next_item() && reader.read_int(turf.height) && !reader.next_item()))
+                cells.turf.push_back(turf);
+        }
+        reader.leave(depth);
+    }
+    return !reader.failed();
+}
+
+// Reads [x, y, [tile, tile, ...]], optionally followed by width and height
+static bool decode_obj_list(JSONReader &reader, const char *text, DecodedCells &cells, std::unordered_map<std::string_view, uint32_t> &tile_numbers, bool can_have_size) {
+    if(!reader.enter_array())
+        return false;
+    while(reader.next_item()) {
+        size_t depth = reader.depth();
+        DecodedCells::Objs objs = {0, 0, 1, 1, (uint32_t)cells.obj_tiles.size(), 0};
+        if(read_cell_position(reader, objs.x, objs.y) && reader.enter_array()) {
+            while(reader.next_item())
+                cells.obj_tiles.push_back(decode_tile(reader, text, cells, tile_numbers));
+            objs.count = cells.obj_tiles.size() - objs.first;
+            if(!can_have_size || !reader.next_item() || (reader.read_int(objs.width) && reader.next_item() && reader.read_int(objs.height) && !reader.next_item()))
+                cells.objs.push_back(objs);
+            else
+                cells.obj_tiles.resize(objs.first);
+        }
+        reader.leave(depth);
+    }
+    return !reader.failed();
+}
+
+// Reads what it can out of the JSON after the command, without touching any client state.
+// Returns false if the message needs websocket_message()'s cJSON path instead.
+static bool decode_message_json(int command, const char *json, size_t length, DecodedMessage &out) {
+    JSONReader reader(json, length);
+    std::unordered_map<std::string_view, uint32_t> tile_numbers;
+    switch(command) {
+    case protocol_command_as_int('M', 'O', 'V'):
+    {
+        enum {MOV_TO, MOV_FROM, MOV_DIR, MOV_ID, MOV_OFFSET};
+        static const char *const names[] = {"to", "from", "dir", "id", "offset"};
+        size_t at[5];
+        if(!find_json_keys(reader, 5, names, at))
+            return false;
+
+        EntityMove &move = out.move;
+        move = EntityMove();
+        if(at[MOV_ID] != JSON_KEY_NOT_FOUND) {
+            reader.seek(at[MOV_ID]);
+            reader.read_string_or_int(out.entity_id);
+        }
+        move.has_from = at[MOV_FROM] != JSON_KEY_NOT_FOUND;
+        if(at[MOV_TO] != JSON_KEY_NOT_FOUND) {
+            int to[2];
+            reader.seek(at[MOV_TO]);
+            if((move.has_to = reader.read_int_array(2, to))) {
+                move.to_x = to[0];
+                move.to_y = to[1];
+            }
+        }
+        if(at[MOV_OFFSET] != JSON_KEY_NOT_FOUND) {
+            int offset[2] = {0, 0};
+            move.has_offset = true;
+            reader.seek(at[MOV_OFFSET]);
+            if(reader.read_int_array(2, offset)) {
+                move.offset_x = offset[0];
+                move.offset_y = offset[1];
+            }
+        }
+        if(at[MOV_DIR] != JSON_KEY_NOT_FOUND) {
+            reader.seek(at[MOV_DIR]);
+            move.has_dir = reader.read_int(move.dir);
+        }
+        return true;
+    }
+
+    case protocol_command_as_int('M', 'A', 'P'):
+    {
+        enum {MAP_POS, MAP_DEFAULT, MAP_TURF, MAP_OBJ};
+        static const char *const names[] = {"pos", "default", "turf", "obj"};
+        size_t at[4];
+        if(!find_json_keys(reader, 4, names, at)
+        || at[MAP_POS] == JSON_KEY_NOT_FOUND || at[MAP_DEFAULT] == JSON_KEY_NOT_FOUND || at[MAP_TURF] == JSON_KEY_NOT_FOUND || at[MAP_OBJ] == JSON_KEY_NOT_FOUND)
+            return false;
+
+        auto cells = std::make_unique<DecodedCells>();
+        cells->tiles.emplace_back(); // Number 0 is for values that aren't tiles
+        reader.seek(at[MAP_POS]);
+        cells->has_pos = reader.read_int_array(4, cells->pos);
+        reader.seek(at[MAP_DEFAULT]);
+        cells->default_tile = decode_tile(reader, json, *cells, tile_numbers);
+        reader.seek(at[MAP_TURF]);
+        decode_turf_list(reader, json, *cells, tile_numbers, false);
+        reader.seek(at[MAP_OBJ]);
+        decode_obj_list(reader, json, *cells, tile_numbers, false);
+
+        out.cells = std::move(cells);
+        return true;
+    }
+
+    case protocol_command_as_int('B', 'L', 'K'):
+    {
+        enum {BLK_COPY, BLK_TURF, BLK_OBJ};
+        static const char *const names[] = {"copy", "turf", "obj"};
+        size_t at[3];
+        if(!find_json_keys(reader, 3, names, at) || at[BLK_COPY] != JSON_KEY_NOT_FOUND)
+            return false;
+
+        auto cells = std::make_unique<DecodedCells>();
+        cells->tiles.emplace_back();
+        if(at[BLK_TURF] != JSON_KEY_NOT_FOUND) {
+            reader.seek(at[BLK_TURF]);
+            decode_turf_list(reader, json, *cells, tile_numbers, true);
+        }
+        if(at[BLK_OBJ] != JSON_KEY_NOT_FOUND) {
+            reader.seek(at[BLK_OBJ]);
+            decode_obj_list(reader, json, *cells, tile_numbers, true);
+        }
+
+        out.cells = std::move(cells);
+        return true;
+    }
+
+    case protocol_command_as_int('W', 'H', 'O'):
+    {
+        // Only the parts of WHO that come in large amounts are decoded here; updates log status changes, so they take the cJSON path
+        enum {WHO_TYPE, WHO_YOU, WHO_LIST, WHO_ADD, WHO_REMOVE};
+        static const char *const names[] = {"type", "you", "list", "add", "remove"};
+        size_t at[5];
+        if(!find_json_keys(reader, 5, names, at) || has_other_json_keys(reader, 5, names))
+            return false;
+
+        if(at[WHO_TYPE] != JSON_KEY_NOT_FOUND) {
+            std::string type;
+            reader.seek(at[WHO_TYPE]);
+            if(reader.read_string(type) && type != "map")
+                return true; // Nothing to apply
+        }
+
+        if(at[WHO_YOU] != JSON_KEY_NOT_FOUND) {
+            reader.seek(at[WHO_YOU]);
+            out.has_you = true;
+            out.you_is_valid = reader.read_string_or_int(out.you);
+        }
+
+        if(at[WHO_LIST] != JSON_KEY_NOT_FOUND) {
+            reader.seek(at[WHO_LIST]);
+            if(reader.enter_object()) {
+                out.has_list = true;
+                std::string_view key;
+                while(reader.next_key(key)) {
+                    if(reader.peek() != JSON_OBJECT)
+                        break;
+                    out.list.emplace_back();
+                    decode_entity(reader, out.list.back());
+                }
+            }
+        }
+
+        if(at[WHO_ADD] != JSON_KEY_NOT_FOUND) {
+            reader.seek(at[WHO_ADD]);
+            if(reader.peek() == JSON_OBJECT) {
+                out.add = std::make_unique<DecodedEntity>();
+                decode_entity(reader, *out.add);
+            }
+        }
+
+        if(at[WHO_REMOVE] != JSON_KEY_NOT_FOUND) {
+            reader.seek(at[WHO_REMOVE]);
+            out.has_remove = reader.read_string_or_int(out.remove);
+        }
+        return true;
+    }
+    }
+    return false;
+}
+
+// Doesn't touch any client state, so it's safe to call on any thread. Returns false if nothing could be decoded
+// ahead of time; 'out' then just holds the text.
+bool decode_message(const char *text, size_t length, DecodedMessage &out) {
+    out.decoded = false;
+    if(length < 3)
+        return false;
+    out.command = protocol_command_as_int(text[0], text[1], text[2]);
+
+    if(out.command == protocol_command_as_int('B', 'A', 'T') && length > 4 && text[3] == ' ') {
+        const char *line = text + 4, *end = text + length;
+        while(line < end) {
+            const char *newline = (const char*)memchr(line, '\n', end - line);
+            if(!newline)
+                newline = end;
+            out.batch.emplace_back();
+            decode_message(line, newline - line, out.batch.back());
+            line = newline + 1;
+        }
+        out.decoded = true;
+        return true;
+    }
+    if(length > 4 && decode_message_json(out.command, text + 4, length - 4, out)) {
+        out.decoded = true;
+        return true;
+    }
+
+    out.text.assign(text, length);
+    return false;
+}
+
+void TilemapTownClient::apply_decoded(DecodedMessage &message) {
+    if(!message.decoded) {
+        this->websocket_message(message.text.data(), message.text.size());
+        return;
+    }
+    if(this->in_batch && message.command != protocol_command_as_int('M', 'O', 'V') && message.command != protocol_command_as_int('B', 'L', 'K'))
+        this->flush_batch();
+
+    switch(message.command) {
+    case protocol_command_as_int('B', 'A', 'T'):
+        this->in_batch = true;
+        for(DecodedMessage &line : message.batch)
+            this->apply_decoded(line);
+        this->flush_batch();
+        this->in_batch = false;
+        break;
+
+    case protocol_command_as_int('M', 'O', 'V'):
+        if(message.entity_id.empty())
+            break;
+        message.move.id = this->who.find_id(message.entity_id);
+        if(message.move.id)
+            this->apply_move(message.move);
+        break;
+
+    case protocol_command_as_int('M', 'A', 'P'):
+    case protocol_command_as_int('B', 'L', 'K'):
+    {
+        bool is_map = message.command == protocol_command_as_int('M', 'A', 'P');
+
+        // Intern each different tile once
+        DecodedCells &cells = *message.cells;
+        std::vector<MapTileID> tile_ids(cells.tiles.size(), 0);
+        for(size_t i=1; i<cells.tiles.size(); i++) {
+            JSONReader reader(cells.tiles[i].data(), cells.tiles[i].size());
+            tile_ids[i] = this->tile_from_json(reader);
+        }
+
+        if(!is_map) {
+            for(const DecodedCells::Turf &turf : cells.turf)
+                this->fill_turf(turf.x, turf.y, turf.width, turf.height, tile_ids[turf.tile]);
+            for(const DecodedCells::Objs &objs : cells.objs) {
+                this->obj_buffer.clear();
+                for(uint32_t i=0; i<objs.count; i++)
+                    this->obj_buffer.push_back(tile_ids[cells.obj_tiles[objs.first + i]]);
+                this->fill_objs(objs.x, objs.y, objs.width, objs.height, this->obj_buffer.data(), this->obj_buffer.size());
+            }
+            this->need_redraw = true;
+            break;
+        }
+
+        this->map_received = true;
+        TownMap *map = &this->town_map;
+        int pos[4] = {0, 0, map->width-1, map->height-1};
+        if(cells.has_pos) {
+            if(cells.pos[0] > cells.pos[2] || cells.pos[1] > cells.pos[3])
+                break;
+            pos[0] = std::max(cells.pos[0], 0);
+            pos[1] = std::max(cells.pos[1], 0);
+            pos[2] = std::min(cells.pos[2], map->width-1);
+            pos[3] = std::min(cells.pos[3], map->height-1);
+            for(int y=pos[1]; y<=pos[3]; y++) {
+                for(int x=pos[0]; x<=pos[2]; x++) {
+                    int index = y * map->width + x;
+                    map->turf[index] = tile_ids[cells.default_tile];
+                    map->set_objs(index, nullptr, 0);
+                }
+            }
+        }
+        for(const DecodedCells::Turf &turf : cells.turf) {
+            if(turf.x >= 0 && turf.y >= 0 && turf.x < map->width && turf.y < map->height) {
+                int index = turf.y * map->width + turf.x;
+                map->turf[index] = tile_ids[turf.tile];
+                map->set_objs(index, nullptr, 0);
+            }
+        }
+        for(const DecodedCells::Objs &objs : cells.objs) {
+            if(objs.x >= 0 && objs.y >= 0 && objs.x < map->width && objs.y < map->height) {
+                this->obj_buffer.clear();
+                for(uint32_t i=0; i<objs.count; i++)
+                    this->obj_buffer.push_back(tile_ids[cells.obj_tiles[objs.first + i]]);
+                map->set_objs(objs.y * map->width + objs.x, this->obj_buffer.data(), this->obj_buffer.size());
+            }
+        }
+        this->map_cells_changed(pos[0], pos[1], pos[2], pos[3]);
+        this->need_redraw = true;
+        break;
+    }
+
+    case protocol_command_as_int('W', 'H', 'O'):
+        if(message.has_you) {
+            if(message.you_is_valid)
+                this->your_id = this->who.intern_id(message.you);
+            this->dirty_everything = true;
+        }
+
+        if(message.has_list) {
+            this->clear_entities();
+            this->dirty_everything = true;
+            for(DecodedEntity &entity : message.list) {
+                EntityID id = entity.intern_ids(this->who);
+                if(id)
+                    this->set_entity(id, entity.entity);
+            }
+        }
+
+        if(message.add) {
+            EntityID id = message.add->intern_ids(this->who);
+            if(id) {
+                this->set_entity(id, message.add->entity);
+                this->mark_dirty(message.add->entity.map_rect());
+            }
         }
+
+        if(message.has_remove) {
+            EntityID id = this->who.find_id(message.remove);
+            Entity *entity = this->who.find(id);
+            if(entity) {
+                this->mark_dirty(entity->map_rect());
+                this->remove_entity(id);
+            }
+        }
+        this->release_entity_ids();
+        this->need_redraw = true;
+        break;
     }
+
+    if(this->need_redraw && !this->in_batch) {
+        this->request_draw();
+        this->need_redraw = false;
+    }
+}
+
+bool TilemapTownClient::websocket_message_streaming(int command, const char *text, size_t length) {
+    // Returns false if the message should go through the cJSON path instead
+    DecodedMessage message;
+    message.command = command;
+    if(!decode_message_json(command, text, length, message))
+        return false;
+    message.decoded = true;
+    this->apply_decoded(message);
+    return true;
+}
+
+void TilemapTownClient::flush_batch() {
+    for(auto &[id, move] : this->batch_moves)
+        this->move_entity(move);
+    this->batch_moves.clear();
+
+    for(MapFill &fill : this->batch_fills)
+        this->write_fill(fill, this->batch_fill_objs.data() + fill.obj_start);
+    this->batch_fills.clear();
+    this->batch_fill_objs.clear();
+
+    for(MapRect &rect : this->batch_changed_cells)
+        this->refresh_cells(rect.x1, rect.y1, rect.x2, rect.y2);
+    this->batch_changed_cells.clear();
 }
 
 void TilemapTownClient::websocket_message(const char *text, size_t length) {
     if(length < 3)
         return;
+
+    // Batch messages need special parsing
+    if(length > 4 && text[0] == 'B' && text[1] == 'A' && text[2] == 'T' && text[3] == ' ') {
+        // MOV and BLK lines are collected and applied together; see apply_move, fill_turf and fill_objs
+        this->in_batch = true;
+        const char *line = text + 4, *end = text + length;
+        while(line < end) {
+            const char *newline = (const char*)memchr(line, '\n', end - line);
+            if(!newline)
+                newline = end;
+            this->websocket_message(line, newline - line);
+            line = newline + 1;
+        }
+        this->flush_batch();
+        this->in_batch = false;
+        if (this->need_redraw) {
+            this->request_draw();
+            this->need_redraw = false;
+        }
+        return;
+    }
+
+    // Anything else in a batch may depend on the MOVs and BLKs before it having been applied
+    int command = protocol_command_as_int(text[0], text[1], text[2]);
+    if(this->in_batch && command != protocol_command_as_int('M', 'O', 'V') && command != protocol_command_as_int('B', 'L', 'K'))
+        this->flush_batch();
+
+    // Everything cJSON allocates while handling this message is released at once at the end, instead of by cJSON_Delete
+    JSONArenaScope arena_scope(this->json_arena);
     cJSON *json = NULL;
 
     if(length > 4) {
-        // Batch messages need special parsing
-        if(text[0] == 'B' && text[1] == 'A' && text[2] == 'T' && text[3] == ' ') {
-            this->in_batch = true;
-            size_t base = 4, scan = 4;
-            while(scan < length) {
-                if(text[scan] == '\n') {
-                    this->websocket_message(text+base, scan-base);
-                    base = scan+1;
-                }
-                scan++;
-            }
-            this->websocket_message(text+base, scan-base);
-            this->in_batch = false;
-            if (this->need_redraw) {
+        if(this->streaming_parser && this->websocket_message_streaming(command, text+4, length-4)) {
+            if(this->need_redraw && !this->in_batch) {
                 this->request_draw();
                 this->need_redraw = false;
             }
@@ -364,7 +1057,7 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
     }
     // printf("Received %c%c%c\n", text[0], text[1], text[2]);
 
-    switch(protocol_command_as_int(text[0], text[1], text[2])) {
+    switch(command) {
     case protocol_command_as_int('P', 'I', 'N'):
         this->websocket_write("PIN");
         break;
@@ -378,38 +1071,24 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
         cJSON *i_offset = get_json_item(json, "offset");
         if(!cJSON_IsString(i_id) && !cJSON_IsNumber(i_id))
             break;
-        std::string str_id = json_as_string(i_id);
-        if(str_id == this->your_id && i_from)
+        EntityMove move = EntityMove();
+        move.id = this->entity_id_from_json(i_id);
+        if(!move.id)
             break;
-        // Find this entity
-        auto it = this->who.find(str_id);
-        if(it != this->who.end()) {
-            int to_x, to_y, offset_x, offset_y;
-            Entity *entity = &(*it).second;
-
-            if(unpack_json_int_array(i_to, 2, &to_x, &to_y)) {
-                entity->x = to_x;
-                entity->y = to_y;
-                if(entity->vehicle_id.empty() || entity->is_following) {
-                    entity->walk_timer = 30+1; // 30*(16.6666ms/1000) = 0.5
-                }
-            }
-
-            if(i_offset) {
-                if(unpack_json_int_array(i_offset, 2, &offset_x, &offset_y)) {
-                    entity->offset_x = offset_x;
-                    entity->offset_y = offset_y;
-                } else {
-                    entity->offset_x = 0;
-                    entity->offset_y = 0;
-                }
-            }
-
-            if(cJSON_IsNumber(i_dir)) {
-                entity->update_direction(i_dir->valueint);
+        move.has_from = i_from != nullptr;
+        move.has_to = unpack_json_int_array(i_to, 2, &move.to_x, &move.to_y);
+        if(i_offset) {
+            move.has_offset = true;
+            if(!unpack_json_int_array(i_offset, 2, &move.offset_x, &move.offset_y)) {
+                move.offset_x = 0;
+                move.offset_y = 0;
             }
         }
-        this->need_redraw = true;
+        if(cJSON_IsNumber(i_dir)) {
+            move.has_dir = true;
+            move.dir = i_dir->valueint;
+        }
+        this->apply_move(move);
         break;
     }
 
@@ -418,7 +1097,7 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
         // <-- MAI {"name": map_name, "id": map_id, "owner": whoever, "admins": list, "default": default_turf, "size": [width, height], "public": true/false, "private": true/false, "build_enabled": true/false, "full_sandbox": true/false, "you_allow": list, "you_deny": list
         if(get_json_item(json, "remote_map"))
             break;
-        this->json_tileset.clear();
+        this->tiles.begin_epoch();
         this->map_received = false;
 
         cJSON *i_name          = get_json_item(json, "name");
@@ -437,6 +1116,7 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
         int width, height;
         if(unpack_json_int_array(i_size, 2, &width, &height)) {
             this->town_map.init_map(width, height);
+            this->rebuild_entity_rows();
         }
 
         this->town_map.name = i_name ? json_as_string(i_name) : "";
@@ -458,17 +1138,19 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
         if(!i_pos || !i_default || !i_turf || !i_obj)
             break;
 
-        MapTileReference default_tile = MapTileReference(i_default, this);
+        TownMap *map = &this->town_map;
+        MapTileID default_tile = this->tile_from_json(i_default);
 
         // Write default turf
-        int x1, y1, x2, y2;
+        int x1 = 0, y1 = 0, x2 = map->width-1, y2 = map->height-1;
         if(unpack_json_int_array(i_pos, 4, &x1, &y1, &x2, &y2)) {
             if(x1 > x2 || y1 > y2)
                 break;
-            for(int x=x1; x<=x2; x++) {
-                for(int y=y1; y<=y2; y++) {
-                    int index = y * this->town_map.width + x;
-                    this->town_map.cells[index] = MapCell(default_tile);
+            for(int y=y1; y<=y2; y++) {
+                for(int x=x1; x<=x2; x++) {
+                    int index = y * map->width + x;
+                    map->turf[index] = default_tile;
+                    map->set_objs(index, nullptr, 0);
                 }
             }
         }
@@ -482,11 +1164,13 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
             cJSON *i_y    = cJSON_GetArrayItem(element, 1);
             cJSON *i_tile = cJSON_GetArrayItem(element, 2);
             if(cJSON_IsNumber(i_x) && cJSON_IsNumber(i_y)) {
-                int index = i_y->valueint * this->town_map.width + i_x->valueint;
-                this->town_map.cells[index] = MapCell(MapTileReference(i_tile, this));
+                int index = i_y->valueint * map->width + i_x->valueint;
+                map->turf[index] = this->tile_from_json(i_tile);
+                map->set_objs(index, nullptr, 0);
             }
         }
 
+        std::vector<MapTileID> objs;
         cJSON_ArrayForEach(element, i_obj) {
             if(cJSON_GetArraySize(element) != 3)
                 continue;
@@ -494,24 +1178,29 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
             cJSON *i_y    = cJSON_GetArrayItem(element, 1);
             cJSON *i_tile = cJSON_GetArrayItem(element, 2);
             if(cJSON_IsNumber(i_x) && cJSON_IsNumber(i_y)) {
-                int index = i_y->valueint * this->town_map.width + i_x->valueint;
-
-                std::vector<struct MapTileReference> *objs = &this->town_map.cells[index].objs;
-                objs->clear();
+                int index = i_y->valueint * map->width + i_x->valueint;
 
+                objs.clear();
                 cJSON *object;
                 cJSON_ArrayForEach(object, i_tile) {
-                    objs->push_back(MapTileReference(object, this));
+                    objs.push_back(this->tile_from_json(object));
                 }
+                map->set_objs(index, objs.data(), objs.size());
             }
         }
+        this->map_cells_changed(x1, y1, x2, y2);
         this->need_redraw = true;
         break;
     }
     case protocol_command_as_int('B', 'L', 'K'):
     {
+        TownMap *map = &this->town_map;
+
         cJSON *i_copy = get_json_item(json, "copy");
         if(i_copy) {
+            // Copies read from the map, so earlier fills in the batch need to be there first
+            if(this->in_batch)
+                this->flush_batch();
             cJSON *item;
             cJSON_ArrayForEach(item, i_copy) {
                 if(!cJSON_IsObject(item))
@@ -535,21 +1224,28 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
                 }
                 if(!unpack_json_int_array(i_copy_dst, 2, &copy_to_x, &copy_to_y))
                     break;
-                std::vector<MapCell> copy_buffer;
+                std::vector<MapTileID> copy_turf;
+                std::vector<uint32_t> copy_obj_start;
+                std::vector<uint16_t> copy_obj_count;
+                std::vector<MapTileID> copy_objs;
 
                 // Make a copy of the area
                 for(int rect_y = 0; rect_y < copy_from_h; rect_y++) {
                     for(int rect_x = 0; rect_x < copy_from_w; rect_x++) {
                         int map_x = copy_from_x + rect_x;
                         int map_y = copy_from_y + rect_y;
-                        if(map_x < 0 || map_y < 0 || map_x >= this->town_map.width || map_y >= this->town_map.height)
+                        if(map_x < 0 || map_y < 0 || map_x >= map->width || map_y >= map->height)
                             continue;
-                        int map_index = map_y * this->town_map.width + map_x;
-                        copy_buffer.push_back(this->town_map.cells[map_index]);
+                        int map_index = map_y * map->width + map_x;
+                        copy_turf.push_back(map->turf[map_index]);
+                        copy_obj_start.push_back(copy_objs.size());
+                        copy_obj_count.push_back(map->obj_count[map_index]);
+                        copy_objs.insert(copy_objs.end(), map->obj_pool.begin() + map->obj_start[map_index],
+                            map->obj_pool.begin() + map->obj_start[map_index] + map->obj_count[map_index]);
                     }
                 }
 
-                if(copy_buffer.size() != (size_t)(copy_from_w * copy_from_h))
+                if(copy_turf.size() != (size_t)(copy_from_w * copy_from_h))
                     break;
 
                 // Copy the tiles into the place
@@ -557,20 +1253,19 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
                     for(int rect_x = 0; rect_x < copy_from_w; rect_x++) {
                         int map_x = copy_to_x + rect_x;
                         int map_y = copy_to_y + rect_y;
-                        if(map_x < 0 || map_y < 0 || map_x >= this->town_map.width || map_y >= this->town_map.height)
+                        if(map_x < 0 || map_y < 0 || map_x >= map->width || map_y >= map->height)
                             continue;
 
-                        int map_index = map_y * this->town_map.width + map_x;
+                        int map_index = map_y * map->width + map_x;
                         int rect_index = rect_y * copy_from_w + rect_x;
 
-                        MapCell *cell = &this->town_map.cells[map_index];
                         if(b_copy_turf)
-                            cell->turf = copy_buffer[rect_index].turf;
+                            map->turf[map_index] = copy_turf[rect_index];
                         if(b_copy_obj)
-                            cell->objs = copy_buffer[rect_index].objs;
+                            map->set_objs(map_index, copy_objs.data() + copy_obj_start[rect_index], copy_obj_count[rect_index]);
                     }
                 }
-
+                this->map_cells_changed(copy_to_x, copy_to_y, copy_to_x + copy_from_w - 1, copy_to_y + copy_from_h - 1);
             }
         }
 
@@ -593,22 +1288,13 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
                 if(!cJSON_IsNumber(i_x) || !cJSON_IsNumber(i_y) || (i_w&&!cJSON_IsNumber(i_w)) || (i_h&&!cJSON_IsNumber(i_h)) )
                     continue;
 
-                MapTileReference tile = MapTileReference(i_t, this);
-                for(int rect_y = 0; rect_y < height; rect_y++) {
-                    for(int rect_x = 0; rect_x < width; rect_x++) {
-                        int map_x = i_x->valueint + rect_x;
-                        int map_y = i_y->valueint + rect_y;
-                        if(map_x < 0 || map_y < 0 || map_x >= this->town_map.width || map_y >= this->town_map.height)
-                            continue;
-                        size_t map_index = map_y * this->town_map.width + map_x;
-                        this->town_map.cells[map_index].turf = tile;
-                    }
-                }
+                this->fill_turf(i_x->valueint, i_y->valueint, width, height, this->tile_from_json(i_t));
             }
         }
 
         cJSON *i_obj = get_json_item(json, "obj");
         if(i_obj) {
+            std::vector<MapTileID> objs;
             cJSON *item;
             cJSON_ArrayForEach(item, i_obj) {
                 if(!cJSON_IsArray(item))
@@ -627,21 +1313,12 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
                     continue;
 
                 // Get object list
-                std::vector<struct MapTileReference> objs;
+                objs.clear();
                 cJSON *object;
                 cJSON_ArrayForEach(object, i_t) {
-                    objs.push_back(MapTileReference(object, this));
-                }
-                for(int rect_y = 0; rect_y < height; rect_y++) {
-                    for(int rect_x = 0; rect_x < width; rect_x++) {
-                        int map_x = i_x->valueint + rect_x;
-                        int map_y = i_y->valueint + rect_y;
-                        if(map_x < 0 || map_y < 0 || map_x >= this->town_map.width || map_y >= this->town_map.height)
-                            continue;
-                        size_t map_index = map_y * this->town_map.width + map_x;
-                        this->town_map.cells[map_index].objs = objs;
-                    }
+                    objs.push_back(this->tile_from_json(object));
                 }
+                this->fill_objs(i_x->valueint, i_y->valueint, width, height, objs.data(), objs.size());
             }
         }
         this->need_redraw = true;
@@ -656,30 +1333,34 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 
         cJSON *i_you = get_json_item(json, "you");
         if(i_you) {
-            this->your_id = json_as_string(i_you);
+            this->your_id = this->who.intern_id(json_as_string(i_you));
+            this->dirty_everything = true;
         }
 
         cJSON *i_list = get_json_item(json, "list");
         if(cJSON_IsObject(i_list)) {
-            this->who.clear();
+            this->clear_entities();
+            this->dirty_everything = true;
 
             cJSON *i_user;
             cJSON_ArrayForEach(i_user, i_list) {
                 if(!cJSON_IsObject(i_user))
                     break;
                 Entity entity = Entity();
-                std::string id = entity.apply_json(i_user);
-                if(!id.empty())
-                    this->who[id] = entity;
+                EntityID id = entity.apply_json(i_user, this->who);
+                if(id)
+                    this->set_entity(id, entity);
             }
         }
 
         cJSON *i_add = get_json_item(json, "add");
         if(cJSON_IsObject(i_add)) {
             Entity entity = Entity();
-            std::string id = entity.apply_json(i_add);
-            if(!id.empty())
-                this->who[id] = entity;
+            EntityID id = entity.apply_json(i_add, this->who);
+            if(id) {
+                this->set_entity(id, entity);
+                this->mark_dirty(entity.map_rect());
+            }
         }
 
         cJSON *i_update = get_json_item(json, "update");
@@ -687,15 +1368,18 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
             cJSON *i_id = get_json_item(i_update, "id");
             if(!i_id) break;
 
-            auto it = this->who.find(json_as_string(i_id));
-            if(it != this->who.end()) {
-                std::string id = (*it).second.apply_json(i_update);
+            Entity *entity = this->who.find(this->entity_id_from_json(i_id));
+            if(entity) {
+                this->mark_dirty(entity->map_rect());
+                EntityID id = entity->apply_json(i_update, this->who);
+                this->entity_moved(entity);
+                this->mark_dirty(entity->map_rect());
 
                 if (get_json_item(i_update, "status")) {
                     const char *i_status = get_json_string(i_update, "status");
                     const char *i_status_message = get_json_string(i_update, "status_message");
                     std::string safe_name, safe_status = "", safe_message = "";
-                    html_encode(safe_name, (*it).second.name.c_str());
+                    html_encode(safe_name, entity->name.c_str());
                     if (i_status)
                         html_encode(safe_status, i_status);
                     if (i_status_message)
@@ -728,7 +1412,12 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
 
         cJSON *i_remove = get_json_item(json, "remove");
         if(cJSON_IsString(i_remove) || cJSON_IsNumber(i_remove)) {
-            this->who.erase(json_as_string(i_remove));
+            EntityID id = this->entity_id_from_json(i_remove);
+            Entity *entity = this->who.find(id);
+            if(entity) {
+                this->mark_dirty(entity->map_rect());
+                this->remove_entity(id);
+            }
         }
 
         cJSON *i_new_id = get_json_item(json, "new_id");
@@ -737,19 +1426,15 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
             cJSON *i_id2 = get_json_item(i_new_id, "new_id");
             if(!i_id || !i_id2)
                 break;
-            std::string str_id     = json_as_string(i_id);
-            std::string str_new_id = json_as_string(i_id2);
-
-            if(str_id == this->your_id) {
-                this->your_id = str_new_id;
-            }
+            EntityID id     = this->who.intern_id(json_as_string(i_id));
+            EntityID new_id = this->who.intern_id(json_as_string(i_id2));
 
-            auto it = this->who.find(str_id);
-            if(it != this->who.end()) {
-                this->who[str_new_id] = (*it).second;
-                this->who.erase(str_id);
+            if(id == this->your_id) {
+                this->your_id = new_id;
             }
+            this->rename_entity(id, new_id);
         }
+        this->release_entity_ids();
         this->need_redraw = true;
         break;
     }
@@ -798,6 +1483,7 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
             }
         }
         cJSON *i_tilesets = get_json_item(json, "tilesets");
+        std::unordered_set<MapTileID> defined_tiles;
         if(i_tilesets) {
             cJSON *tileset;
             cJSON_ArrayForEach(tileset, i_tilesets) {
@@ -816,10 +1502,15 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
                     map_tile_from_json(tile_in_tileset, &tile);
                     tile.key = key;
 
-                    this->tileset[prefix+key] = std::make_shared<MapTileInfo>(tile);
+                    defined_tiles.insert(this->tiles.define(prefix+key, tile));
                 }
             }
         }
+        this->asset_revision++;
+        this->need_redraw = true;
+
+        // Cells using the new definitions may autotile, animate and collide differently, and so may their neighbors
+        this->tiles_changed(defined_tiles);
         break;
     }
 
@@ -833,6 +1524,8 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
             std::string id = json_as_string(i_id);
             this->url_for_tile_sheet[id] = i_url;
             this->requested_tile_sheets.erase(id);
+            this->asset_revision++;
+            this->need_redraw = true;
         }
         break;
     }
@@ -927,8 +1620,6 @@ void TilemapTownClient::websocket_message(const char *text, size_t length) {
     }
     }
 
-    if(json)
-        cJSON_Delete(json);
     if(this->need_redraw && !this->in_batch) {
         this->request_draw();
         this->need_redraw = false;
@@ -944,7 +1635,7 @@ void TilemapTownClient::websocket_write(std::string command, cJSON *json) {
     if(!as_string)
         return;
     this->websocket_write(command + " " + std::string(as_string));
-    free(as_string);
+    cJSON_free(as_string);
 }
 
 void TilemapTownClient::request_image_asset(std::string key) {
@@ -0,0 +1,234 @@
+/*
+ * Tilemap Town native client
+ *
+ * Copyright (C) 2023-2025 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Paints TilemapTownMapView into a QImage at several sizes and scales, without a display, and reports how long it took.
+// The map comes from a session recorded with "TilemapTown --record file", or from a generator if no log is given.
+// Usage: TilemapTownRenderBenchmark [-n frames] [session_log]
+// This uses the offscreen platform unless QT_QPA_PLATFORM says otherwise, so it works on a machine with no display.
+
+#include "tilemaptownmapview.h"
+#include "townfilecache.h"
+#include "town.h"
+#include "sessionlog.h"
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QPainter>
+#include <random>
+
+#define SYNTHETIC_MAP_SIZE   256
+#define SYNTHETIC_ENTITIES   200
+#define SYNTHETIC_AVATARS    4
+#define ASSET_WAIT_SECONDS   30
+#define FRAMES_PER_ANIMATION 6 // Advance animation_tick this often, like a 60fps display would
+
+static const char *synthetic_sheet_url = "https://bench.invalid/tiles.png";
+
+static std::string synthetic_avatar_url(int i) {
+    return "https://bench.invalid/avatar" + std::to_string(i) + ".png";
+}
+
+// A tile sheet of 16x16 tiles, each a different color with a border, so they aren't all alike to the painter
+static QImage synthetic_tile_sheet() {
+    QImage sheet(256, 256, QImage::Format_ARGB32_Premultiplied);
+    sheet.fill(Qt::transparent);
+    QPainter painter(&sheet);
+    for (int y=0; y<16; y++) {
+        for (int x=0; x<16; x++) {
+            QColor color = QColor::fromHsv((x * 16 + y * 37) % 360, 160, 200, y >= 8 ? 160 : 255);
+            painter.fillRect(x*16, y*16, 16, 16, color);
+            painter.setPen(color.darker());
+            painter.drawRect(x*16, y*16, 15, 15);
+        }
+    }
+    return sheet;
+}
+
+// The first avatar has four directions with four frames each, like a 32x32 walking sprite; the rest are plain 16x16 pictures
+static QImage synthetic_avatar(int i) {
+    int size = i == 0 ? 128 : 16;
+    QImage avatar(size, size, QImage::Format_ARGB32_Premultiplied);
+    avatar.fill(Qt::transparent);
+    QPainter painter(&avatar);
+    painter.setBrush(QColor::fromHsv(i * 70 % 360, 200, 230));
+    for (int y=0; y<size; y+=std::min(size, 32)) {
+        for (int x=0; x<size; x+=std::min(size, 32)) {
+            int cell = std::min(size, 32);
+            painter.drawEllipse(x + cell/4, y + cell/4, cell/2, cell/2);
+        }
+    }
+    return avatar;
+}
+
+static void feed(TilemapTownClient &client, const std::string &message) {
+    client.websocket_message(message.data(), message.size());
+}
+
+// Sends the client a map like a server would, with turf, objects, animated water, "over" roofs and a crowd of entities
+static void load_synthetic_map(TilemapTownClient &client, TownFileCache &cache) {
+    cache.add_image(synthetic_sheet_url, synthetic_tile_sheet());
+    for (int i=0; i<SYNTHETIC_AVATARS; i++)
+        cache.add_image(synthetic_avatar_url(i), synthetic_avatar(i));
+
+    feed(client, std::string("RSC {\"images\": {\"0\": \"") + synthetic_sheet_url + "\"}, \"tilesets\": {\"\": {"
+        "\"grass\": {\"pic\": [0, 0, 0]},"
+        "\"sand\":  {\"pic\": [0, 1, 0]},"
+        "\"stone\": {\"pic\": [0, 2, 0]},"
+        "\"water\": {\"pic\": [0, 0, 1], \"anim_frames\": 4, \"anim_speed\": 3},"
+        "\"flower\": {\"pic\": [0, 3, 0], \"obj\": true},"
+        "\"tree\":  {\"pic\": [0, 4, 0], \"obj\": true, \"density\": true},"
+        "\"roof\":  {\"pic\": [0, 0, 8], \"obj\": true, \"over\": true}"
+        "}}}");
+    feed(client, "MAI {\"name\": \"Benchmark\", \"id\": 1, \"size\": [" + std::to_string(SYNTHETIC_MAP_SIZE) + ", " + std::to_string(SYNTHETIC_MAP_SIZE) + "]}");
+
+    std::mt19937 random(12345);
+    auto chance = [&](int percent) { return (int)(random() % 100) < percent; };
+
+    std::string turf, obj;
+    for (int y=0; y<SYNTHETIC_MAP_SIZE; y++) {
+        for (int x=0; x<SYNTHETIC_MAP_SIZE; x++) {
+            std::string position = "[" + std::to_string(x) + ", " + std::to_string(y) + ", ";
+            const char *tile = nullptr;
+            if ((x / 16 + y / 16) % 5 == 0)
+                tile = "water";
+            else if (chance(20))
+                tile = chance(50) ? "sand" : "stone";
+            if (tile)
+                turf += (turf.empty() ? "" : ",") + position + "\"" + tile + "\"]";
+
+            const char *object = nullptr;
+            if ((x % 24) < 6 && (y % 24) < 4)
+                object = "roof";
+            else if (!tile && chance(15))
+                object = chance(30) ? "tree" : "flower";
+            if (object)
+                obj += (obj.empty() ? "" : ",") + position + "[\"" + object + "\"]]";
+        }
+    }
+    feed(client, "MAP {\"pos\": [0, 0, " + std::to_string(SYNTHETIC_MAP_SIZE-1) + ", " + std::to_string(SYNTHETIC_MAP_SIZE-1) + "], "
+        "\"default\": \"grass\", \"turf\": [" + turf + "], \"obj\": [" + obj + "]}");
+
+    // Everyone is bunched up around the middle of the map, where the camera is
+    std::string list;
+    for (int i=0; i<SYNTHETIC_ENTITIES; i++) {
+        int x = SYNTHETIC_MAP_SIZE/2 + (int)(random() % 60) - 30;
+        int y = SYNTHETIC_MAP_SIZE/2 + (int)(random() % 40) - 20;
+        std::string id = std::to_string(i + 1);
+        list += (list.empty() ? "" : ",") + ("\"" + id + "\": {\"id\": " + id + ", \"name\": \"bench" + id + "\", "
+            "\"pic\": [\"" + synthetic_avatar_url(i % SYNTHETIC_AVATARS) + "\", 0, 0], "
+            "\"x\": " + std::to_string(x) + ", \"y\": " + std::to_string(y) + ", \"dir\": " + std::to_string(i % 8) + "}");
+    }
+    feed(client, "WHO {\"list\": {" + list + "}, \"you\": 1}");
+}
+
+// Replays a recorded session, then waits for the images it uses to download and decode
+static bool load_session_log(TilemapTownClient &client, TownFileCache &cache, const char *path) {
+    std::vector<SessionLogMessage> messages;
+    if (!read_session_log(path, messages) && messages.empty()) {
+        fprintf(stderr, "Can't read %s\n", path);
+        return false;
+    }
+    for (const SessionLogMessage &message : messages)
+        client.websocket_message(message.text.data(), message.text.size());
+
+    std::unordered_set<std::string> urls;
+    client.collect_image_urls(urls);
+    cache.begin_map(urls);
+
+    QElapsedTimer wait;
+    wait.start();
+    while (cache.is_busy() && wait.elapsed() < ASSET_WAIT_SECONDS * 1000)
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 50);
+    if (cache.is_busy())
+        fprintf(stderr, "Some images still weren't loaded after %d seconds; they won't be drawn\n", ASSET_WAIT_SECONDS);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QApplication app(argc, argv);
+
+    int frames = 300;
+    const char *path = nullptr;
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "-n") && i+1 < argc)
+            frames = std::max(atoi(argv[++i]), 1);
+        else
+            path = argv[i];
+    }
+
+    TownFileCache cache;
+    TilemapTownClient client;
+    client.http = &cache;
+    cache.client = &client;
+
+    if (path) {
+        if (!load_session_log(client, cache, path))
+            return 1;
+    } else {
+        load_synthetic_map(client, cache);
+    }
+    if (!client.map_received || !client.your_entity()) {
+        fprintf(stderr, "No map to draw; the session needs a MAP and a WHO with \"you\" in it\n");
+        return 1;
+    }
+
+    TilemapTownMapView view;
+    view.tilemapTownClient = &client;
+    view.setTileAnimation(false); // The benchmark advances animation_tick itself
+
+    static const QSize sizes[] = {QSize(640, 480), QSize(1280, 720), QSize(1920, 1080)};
+    static const int scales[] = {1, 2, 3};
+
+    printf("%d frames per size; times are per frame\n", frames);
+    printf("%-10s %5s %9s %8s %8s %8s %8s %8s %8s %8s\n", "size", "scale", "cold ms", "fps",
+           "map ms", "ent ms", "over ms", "tiles", "chunks", "entities");
+    for (const QSize &size : sizes) {
+        view.resize(size);
+        QImage image(size, QImage::Format_ARGB32_Premultiplied);
+        for (int scale : scales) {
+            view.scale = scale;
+
+            // The first frame has to draw every chunk on screen
+            view.dropChunkCache();
+            QElapsedTimer timer;
+            timer.start();
+            view.render(&image);
+            double cold_ms = timer.nsecsElapsed() / 1e6;
+
+            // After that, chunks are reused and only animated cells and entities change
+            view.paintStats = TilemapTownMapView::PaintStats();
+            timer.start();
+            for (int i=0; i<frames; i++) {
+                if (i % FRAMES_PER_ANIMATION == FRAMES_PER_ANIMATION - 1)
+                    client.animation_tick++;
+                view.render(&image);
+            }
+            double seconds = timer.nsecsElapsed() / 1e9;
+
+            const TilemapTownMapView::PaintStats &stats = view.paintStats;
+            printf("%4dx%-5d %5d %9.2f %8.0f %8.3f %8.3f %8.3f %8.0f %8.1f %8.0f\n", size.width(), size.height(), scale, cold_ms,
+                   frames / seconds, stats.mapNanoseconds / 1e6 / frames, stats.entityNanoseconds / 1e6 / frames,
+                   stats.overNanoseconds / 1e6 / frames, (double)stats.tilesDrawn / frames,
+                   (double)stats.chunksDrawn / frames, (double)stats.entitiesDrawn / frames);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Tilemap Town native client
+ *
+ * Copyright (C) 2023-2025 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replays a session recorded with "TilemapTown --record file" through TilemapTownClient::websocket_message,
+// without a window or a server, and reports how long the messages took to process.
+// Usage: TilemapTownReplay [--realtime] [--cjson] [--decoded] session_log
+//   --realtime  Waits between messages as long as the server did, instead of going as fast as possible
+//   --cjson     Uses the cJSON parser for everything instead of the streaming parser
+//   --decoded   Decodes each message first, like the network thread does, and only times applying it
+
+#include "town.h"
+#include "sessionlog.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <algorithm>
+#include <map>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Peak resident memory of this process so far, in kilobytes
+static long peak_memory_kb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return (long)(counters.PeakWorkingSetSize / 1024);
+    return 0;
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+struct CommandStats {
+    int count = 0;
+    qint64 total_ns = 0;
+    qint64 max_ns = 0;
+};
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+
+    bool realtime = false, cjson = false, decoded = false;
+    const char *path = nullptr;
+    for(int i=1; i<argc; i++) {
+        if(!strcmp(argv[i], "--realtime"))
+            realtime = true;
+        else if(!strcmp(argv[i], "--cjson"))
+            cjson = true;
+        else if(!strcmp(argv[i], "--decoded"))
+            decoded = true;
+        else
+            path = argv[i];
+    }
+    if(!path) {
+        fprintf(stderr, "Usage: %s [--realtime] [--cjson] [--decoded] session_log\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<SessionLogMessage> messages;
+    if(!read_session_log(path, messages)) {
+        if(messages.empty()) {
+            fprintf(stderr, "Can't read %s\n", path);
+            return 1;
+        }
+        fprintf(stderr, "%s is cut off; replaying the first %zu messages\n", path, messages.size());
+    }
+    long memory_before_kb = peak_memory_kb();
+
+    TilemapTownClient client;
+    client.http = nullptr;
+    client.streaming_parser = !cjson;
+
+    // Messages are grouped by their command, like "MOV" or "BAT"
+    std::map<std::string, CommandStats> stats;
+    size_t bytes = 0;
+    qint64 busy_ns = 0, decode_ns = 0;
+    QElapsedTimer wall, timer;
+    wall.start();
+    auto replay_start = std::chrono::steady_clock::now();
+    for(const SessionLogMessage &message : messages) {
+        if(realtime)
+            std::this_thread::sleep_until(replay_start + std::chrono::milliseconds(message.time_ms));
+
+        qint64 elapsed;
+        if(decoded) {
+            DecodedMessage decoded_message;
+            timer.start();
+            decode_message(message.text.data(), message.text.size(), decoded_message);
+            decode_ns += timer.nsecsElapsed();
+            timer.start();
+            client.apply_decoded(decoded_message);
+            elapsed = timer.nsecsElapsed();
+        } else {
+            timer.start();
+            client.websocket_message(message.text.data(), message.text.size());
+            elapsed = timer.nsecsElapsed();
+        }
+
+        CommandStats &command = stats[message.text.substr(0, 3)];
+        command.count++;
+        command.total_ns += elapsed;
+        command.max_ns = std::max(command.max_ns, elapsed);
+        busy_ns += elapsed;
+        bytes += message.text.size();
+    }
+    double wall_seconds = wall.nsecsElapsed() / 1e9;
+    double busy_seconds = busy_ns / 1e9;
+
+    printf("%zu messages, %.1f MB, replayed in %.3f s (%.3f s processing)\n", messages.size(), bytes / 1e6, wall_seconds, busy_seconds);
+    printf("%.0f messages/sec while processing\n", busy_seconds > 0 ? messages.size() / busy_seconds : 0.0);
+    if(decoded)
+        printf("%.3f s decoding beforehand, which isn't counted above or below\n", decode_ns / 1e9);
+    printf("Peak memory %ld KB (%ld KB before replaying)\n\n", peak_memory_kb(), memory_before_kb);
+
+    printf("%-8s %8s %12s %10s %10s\n", "command", "count", "total ms", "mean us", "max us");
+    for(const auto &[command, command_stats] : stats) {
+        printf("%-8s %8d %12.2f %10.1f %10.1f\n", command.c_str(), command_stats.count, command_stats.total_ns / 1e6,
+               command_stats.total_ns / 1e3 / command_stats.count, command_stats.max_ns / 1e3);
+    }
+    return 0;
+}
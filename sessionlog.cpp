@@ -0,0 +1,75 @@
+/*
+ * Tilemap Town native client
+ *
+ * Copyright (C) 2023-2025 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "sessionlog.h"
+#include <inttypes.h>
+
+SessionLogWriter::~SessionLogWriter() {
+    this->close();
+}
+
+bool SessionLogWriter::open(const char *path) {
+    this->close();
+    this->file = fopen(path, "wb");
+    this->started = std::chrono::steady_clock::now();
+    return this->file != nullptr;
+}
+
+void SessionLogWriter::close() {
+    if(this->file)
+        fclose(this->file);
+    this->file = nullptr;
+}
+
+void SessionLogWriter::write(const char *text, size_t length) {
+    if(!this->file)
+        return;
+    int64_t time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - this->started).count();
+    fprintf(this->file, "%" PRId64 " %zu\n", time_ms, length);
+    fwrite(text, 1, length, this->file);
+    fputc('\n', this->file);
+    fflush(this->file); // A recording matters most when the client crashes, so don't leave messages in the buffer
+}
+
+bool read_session_log(const char *path, std::vector<SessionLogMessage> &messages) {
+    FILE *file = fopen(path, "rb");
+    if(!file)
+        return false;
+
+    bool complete = true;
+    int64_t time_ms;
+    size_t length;
+    while(fscanf(file, "%" SCNd64 " %zu", &time_ms, &length) == 2) {
+        if(fgetc(file) != '\n') {
+            complete = false;
+            break;
+        }
+        SessionLogMessage &message = messages.emplace_back();
+        message.time_ms = time_ms;
+        message.text.resize(length);
+        if(fread(message.text.data(), 1, length, file) != length || fgetc(file) != '\n') {
+            messages.pop_back();
+            complete = false;
+            break;
+        }
+    }
+    if(!feof(file))
+        complete = false;
+    fclose(file);
+    return complete;
+}
@@ -0,0 +1,55 @@
+/*
+ * Tilemap Town native client
+ *
+ * Copyright (C) 2023-2025 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SESSIONLOG_H
+#define SESSIONLOG_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+
+// Session logs hold every message the server sent, along with when it arrived, so that a session can be replayed later.
+// Each message is written as a line with "<milliseconds since recording started> <length in bytes>",
+// followed by the message itself and a newline; messages can contain newlines themselves, as BAT does.
+struct SessionLogMessage {
+    int64_t time_ms;
+    std::string text;
+};
+
+class SessionLogWriter {
+public:
+    SessionLogWriter() = default;
+    ~SessionLogWriter();
+    SessionLogWriter(const SessionLogWriter&) = delete;
+    SessionLogWriter &operator=(const SessionLogWriter&) = delete;
+
+    bool open(const char *path);
+    void close();
+    bool is_open() const { return this->file != nullptr; }
+    void write(const char *text, size_t length);
+
+private:
+    FILE *file = nullptr;
+    std::chrono::steady_clock::time_point started;
+};
+
+bool read_session_log(const char *path, std::vector<SessionLogMessage> &messages); // Returns false if the file can't be read or is cut off
+
+#endif // SESSIONLOG_H
@@ -0,0 +1,84 @@
+/*
+ * Tilemap Town native client
+ *
+ * Copyright (C) 2023-2025 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+
+// Fixed-size ring buffer for handing things from one thread to one other thread without a lock.
+// Only the producer thread may call push(), and only the consumer thread may call pop().
+template <typename T>
+class SPSCQueue {
+public:
+    explicit SPSCQueue(size_t capacity) {
+        // The capacity is rounded up to a power of two so positions can wrap with a mask
+        size_t size = 2;
+        while(size < capacity)
+            size *= 2;
+        this->mask = size - 1;
+        this->items = std::make_unique<T[]>(size);
+    }
+    SPSCQueue(const SPSCQueue&) = delete;
+    SPSCQueue &operator=(const SPSCQueue&) = delete;
+
+    // Returns false without taking 'item' if the queue is full
+    bool push(T &item) {
+        size_t tail = this->tail.load(std::memory_order_relaxed);
+        if(tail - this->head_cache > this->mask) {
+            this->head_cache = this->head.load(std::memory_order_acquire);
+            if(tail - this->head_cache > this->mask)
+                return false;
+        }
+        this->items[tail & this->mask] = std::move(item);
+        this->tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false if the queue is empty
+    bool pop(T &out) {
+        size_t head = this->head.load(std::memory_order_relaxed);
+        if(head == this->tail_cache) {
+            this->tail_cache = this->tail.load(std::memory_order_acquire);
+            if(head == this->tail_cache)
+                return false;
+        }
+        out = std::move(this->items[head & this->mask]);
+        this->head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Only a hint, since the other thread may be changing it
+    bool empty() const {
+        return this->head.load(std::memory_order_acquire) == this->tail.load(std::memory_order_acquire);
+    }
+
+private:
+    std::unique_ptr<T[]> items;
+    size_t mask;
+
+    // Each side's position and its copy of the other side's are kept on separate cache lines, so the threads don't fight over them
+    alignas(64) std::atomic<size_t> head{0}; // Next slot to pop; written by the consumer
+    size_t tail_cache = 0;
+    alignas(64) std::atomic<size_t> tail{0}; // Next slot to push to; written by the producer
+    size_t head_cache = 0;
+};
+
+#endif // SPSCQUEUE_H
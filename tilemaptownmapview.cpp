@@ -18,21 +18,20 @@
  */
 #include "tilemaptownmapview.h"
 #include "town.h"
+#include "townfilecache.h"
 
 #include <QPainter>
 #include <QPainterStateGuard>
 #include <QKeyEvent>
+#include <QPaintEvent>
 
 inline int positive_modulo(int i, unsigned int n) {
     return (i % n + n) % n;
 }
-bool sort_entity_by_y_pos(Entity *a, Entity *b) {
-    return (a->y < b->y);
-}
 
-const QPixmap *Pic::get_pixmap(TilemapTownClient *client) const {
+const PixmapRegion *Pic::get_pixmap(TilemapTownClient *client, AssetPriority priority) const {
     if (this->key_is_url()) {
-        return client->http->get_pixmap(this->key);
+        return client->http->get_pixmap(this->key, priority);
     }
 
     auto find_url = client->url_for_tile_sheet.find(this->key);
@@ -41,55 +40,364 @@ const QPixmap *Pic::get_pixmap(TilemapTownClient *client) const {
         return nullptr;
     }
 
-    return client->http->get_pixmap((*find_url).second);
+    return client->http->get_pixmap((*find_url).second, priority);
 }
 
+// After a stall, don't try to run more simulation steps than this at once
+#define MAX_SIMULATION_CATCH_UP 10
+
 TilemapTownMapView::TilemapTownMapView(QWidget *parent)
     : QWidget(parent)
 {
     this->tilemapTownClient = nullptr;
+    this->frameTimer.setSingleShot(true);
+    this->frameTimer.setTimerType(Qt::PreciseTimer);
+    connect(&this->frameTimer, &QTimer::timeout, this, &TilemapTownMapView::flushInvalidations);
+    this->sinceLastFrame.start();
+
+    connect(&this->animationTimer, &QTimer::timeout, this, &TilemapTownMapView::animationTick);
+    this->animationTimer.start(100);
+
+    this->simulationTimer.setTimerType(Qt::PreciseTimer);
+    connect(&this->simulationTimer, &QTimer::timeout, this, &TilemapTownMapView::simulationTick);
 }
 
-void TilemapTownMapView::drawMapTile(QPainter *painter, const MapTileInfo *tile, bool obj, int map_x, int map_y, float draw_x, float draw_y, int scale) {
-    int quarters_x[4], quarters_y[4];
-    const QPixmap *pixmap = tile->pic.get_pixmap(this->tilemapTownClient);
-    if (!pixmap)
+void TilemapTownMapView::wakeSimulation() {
+    // The simulation only runs while something is moving
+    if (this->tilemapTownClient == nullptr || this->tilemapTownClient->moving_entities.empty() || this->simulationTimer.isActive())
+        return;
+    this->simulationClock.start();
+    this->simulationStepsRun = 0;
+    this->simulationTimer.start(1000 / SIMULATION_STEPS_PER_SECOND);
+}
+
+void TilemapTownMapView::simulationTick() {
+    TilemapTownClient *client = this->tilemapTownClient;
+    if (client == nullptr) {
+        this->simulationTimer.stop();
         return;
+    }
+
+    // Run however many fixed steps are due by now, so timer jitter doesn't change how fast things move
+    qint64 stepsDue = this->simulationClock.elapsed() * SIMULATION_STEPS_PER_SECOND / 1000;
+    int steps = std::min(stepsDue - this->simulationStepsRun, (qint64)MAX_SIMULATION_CATCH_UP);
+    this->simulationStepsRun = stepsDue;
+    for (int i = 0; i < steps; i++) {
+        if (!client->simulation_step())
+            break;
+    }
+    if (client->moving_entities.empty())
+        this->simulationTimer.stop();
+    this->updateDirtyAreas();
+}
+
+void TilemapTownMapView::setTileAnimation(bool enabled) {
+    if (enabled)
+        this->animationTimer.start(100);
+    else
+        this->animationTimer.stop();
+}
+
+void TilemapTownMapView::animationTick() {
+    TilemapTownClient *client = this->tilemapTownClient;
+    if (client == nullptr)
+        return;
+    client->animation_tick++;
+    if (!client->map_received)
+        return;
+
+    int pixelCameraX, pixelCameraY;
+    if (!this->cameraPosition(pixelCameraX, pixelCameraY))
+        return;
+
+    // Repaint just the animated cells that are on screen
+    TownMap *map = &client->town_map;
+    int chunkPixels = MAP_CHUNK_SIZE*16*this->scale;
+    int cellPixels = 16*this->scale;
+    int chunkX1 = std::max((int)floor(pixelCameraX / (double)chunkPixels), 0);
+    int chunkY1 = std::max((int)floor(pixelCameraY / (double)chunkPixels), 0);
+    int chunkX2 = std::min((int)floor((pixelCameraX + this->width() - 1) / (double)chunkPixels), map->chunks_wide - 1);
+    int chunkY2 = std::min((int)floor((pixelCameraY + this->height() - 1) / (double)chunkPixels), map->chunks_tall - 1);
+    bool anyAnimated = false;
+    for (int chunkY = chunkY1; chunkY <= chunkY2; chunkY++) {
+        for (int chunkX = chunkX1; chunkX <= chunkX2; chunkX++) {
+            for (uint8_t cell : map->chunk_animated_cells[chunkY * map->chunks_wide + chunkX]) {
+                int mapCoordX = chunkX * MAP_CHUNK_SIZE + cell % MAP_CHUNK_SIZE;
+                int mapCoordY = chunkY * MAP_CHUNK_SIZE + cell / MAP_CHUNK_SIZE;
+                if (!this->pendingEverything)
+                    this->pendingRegion += QRect(mapCoordX * cellPixels - pixelCameraX, mapCoordY * cellPixels - pixelCameraY, cellPixels, cellPixels);
+                anyAnimated = true;
+            }
+        }
+    }
+
+    // Characters with more than two frames per direction change frames every other tick
+    if (client->animation_tick % 2 == 0) {
+        int firstRow = std::max((int)floor(pixelCameraY / (double)cellPixels) - 1, 0);
+        int lastRow = std::min((int)floor((pixelCameraY + this->height() - 1) / (double)cellPixels) + 2, (int)client->entity_rows.size() - 1);
+        for (int row = firstRow; row <= lastRow; row++) {
+            for (Entity *entity : client->entity_rows[row]) {
+                if (!entity->pic.key_is_url() || !client->http)
+                    continue;
+                const PixmapRegion *region = client->http->get_pixmap(entity->pic.key, ASSET_PRIORITY_VISIBLE_ENTITY);
+                if (!region || region->rect.width() / 32 < 4)
+                    continue;
+                MapRect rect = entity->map_rect();
+                if (!this->pendingEverything)
+                    this->pendingRegion += QRect(rect.x1 * cellPixels - pixelCameraX, rect.y1 * cellPixels - pixelCameraY,
+                                                 (rect.x2 - rect.x1 + 1) * cellPixels, (rect.y2 - rect.y1 + 1) * cellPixels);
+                anyAnimated = true;
+            }
+        }
+    }
 
-    if (this->tilemapTownClient->calc_pic_quarters(quarters_x, quarters_y, tile, obj, &this->tilemapTownClient->town_map, map_x, map_y, 0)) {
+    if (anyAnimated) {
+        this->invalidationsReceived++;
+        this->scheduleFrame();
+    }
+}
+
+void TilemapTownMapView::setFrameRateCap(int fps) {
+    this->frameRateCap = std::max(fps, 0);
+    // Reschedule anything that's waiting using the new rate
+    if (this->frameTimer.isActive()) {
+        this->frameTimer.stop();
+        this->scheduleFrame();
+    }
+}
+
+void TilemapTownMapView::invalidateAll() {
+    this->invalidationsReceived++;
+    this->pendingEverything = true;
+    this->pendingRegion = QRegion();
+    this->scheduleFrame();
+    this->wakeSimulation();
+}
+
+void TilemapTownMapView::scheduleFrame() {
+    if (this->frameTimer.isActive())
+        return;
+    int delay = 0;
+    if (this->frameRateCap > 0) {
+        // Wait out the rest of the current frame, so a burst of changes becomes one paint
+        int frameInterval = 1000 / this->frameRateCap;
+        delay = std::max(frameInterval - (int)this->sinceLastFrame.elapsed(), 0);
+    }
+    this->frameTimer.start(delay);
+}
+
+void TilemapTownMapView::flushInvalidations() {
+    if (this->pendingEverything) {
+        this->update();
+    } else if (!this->pendingRegion.isEmpty()) {
+        this->update(this->pendingRegion);
+    }
+    this->pendingEverything = false;
+    this->pendingRegion = QRegion();
+}
+
+// How many chunks can stay cached before the ones that aren't on screen get freed
+#define MAX_CACHED_CHUNKS 128
+
+bool TilemapTownMapView::drawMapTile(QPainter *painter, const MapTileInfo *tile, uint8_t autotile_neighbors, float draw_x, float draw_y, int scale) {
+    int quarters_x[4], quarters_y[4];
+    const PixmapRegion *region = tile->pic.get_pixmap(this->tilemapTownClient);
+    if (!region)
+        return false;
+    const QPixmap &pixmap = *region->pixmap;
+    int source_x = region->rect.x(), source_y = region->rect.y();
+    this->paintStats.tilesDrawn++;
+
+    if (this->tilemapTownClient->calc_pic_quarters(quarters_x, quarters_y, tile, autotile_neighbors, this->tilemapTownClient->animation_tick)) {
         // 8x8 tiles
-        painter->drawPixmap(draw_x,         draw_y,         8*scale, 8*scale, *pixmap, quarters_x[0]*8, quarters_y[0]*8, 8, 8);
-        painter->drawPixmap(draw_x+8*scale, draw_y,         8*scale, 8*scale, *pixmap, quarters_x[1]*8, quarters_y[1]*8, 8, 8);
-        painter->drawPixmap(draw_x,         draw_y+8*scale, 8*scale, 8*scale, *pixmap, quarters_x[2]*8, quarters_y[2]*8, 8, 8);
-        painter->drawPixmap(draw_x+8*scale, draw_y+8*scale, 8*scale, 8*scale, *pixmap, quarters_x[3]*8, quarters_y[3]*8, 8, 8);
+        painter->drawPixmap(draw_x,         draw_y,         8*scale, 8*scale, pixmap, source_x+quarters_x[0]*8, source_y+quarters_y[0]*8, 8, 8);
+        painter->drawPixmap(draw_x+8*scale, draw_y,         8*scale, 8*scale, pixmap, source_x+quarters_x[1]*8, source_y+quarters_y[1]*8, 8, 8);
+        painter->drawPixmap(draw_x,         draw_y+8*scale, 8*scale, 8*scale, pixmap, source_x+quarters_x[2]*8, source_y+quarters_y[2]*8, 8, 8);
+        painter->drawPixmap(draw_x+8*scale, draw_y+8*scale, 8*scale, 8*scale, pixmap, source_x+quarters_x[3]*8, source_y+quarters_y[3]*8, 8, 8);
     } else {
         // 16x16 tiles
-        painter->drawPixmap(draw_x, draw_y, 16*scale, 16*scale, *pixmap, quarters_x[0]*16, quarters_y[0]*16, 16, 16);
+        painter->drawPixmap(draw_x, draw_y, 16*scale, 16*scale, pixmap, source_x+quarters_x[0]*16, source_y+quarters_y[0]*16, 16, 16);
+    }
+    return true;
+}
+
+uint32_t TilemapTownMapView::assetRevision() {
+    // Both of these only ever go up, so the sum changes whenever either one does
+    uint32_t revision = this->tilemapTownClient->asset_revision;
+    if (this->tilemapTownClient->http)
+        revision += this->tilemapTownClient->http->revision;
+    return revision;
+}
+
+bool TilemapTownMapView::drawChunkCell(QPainter *painter, int map_x, int map_y, int x, int y) {
+    // Draws the turf and non-"over" objects for one cell, and returns false if anything couldn't be drawn yet
+    TownMap *map = &this->tilemapTownClient->town_map;
+    bool complete = true;
+
+    int index = map_y * map->width + map_x;
+    MapTileID turfID = map->turf[index];
+    MapTileInfo *turf = this->tilemapTownClient->tiles.get(turfID);
+    if (turf) {
+        if (!this->drawMapTile(painter, turf, map->turf_autotile[index], x*16, y*16, 1))
+            complete = false;
+    } else if (turfID) {
+        complete = false;
+    }
+    uint32_t objStart = map->obj_start[index];
+    for (int i = 0; i < map->obj_count[index]; i++) {
+        MapTileInfo *obj = this->tilemapTownClient->tiles.get(map->obj_pool[objStart + i]);
+        if (!obj) {
+            complete = false;
+        } else if (!obj->over) {
+            if (!this->drawMapTile(painter, obj, map->obj_pool_autotile[objStart + i], x*16, y*16, 1))
+                complete = false;
+        }
+    }
+    return complete;
+}
+
+void TilemapTownMapView::drawMapChunk(MapChunk &chunk, int chunk_x, int chunk_y) {
+    TownMap *map = &this->tilemapTownClient->town_map;
+
+    if (!chunk.drawn) {
+        chunk.pixmap = QPixmap(MAP_CHUNK_SIZE*16, MAP_CHUNK_SIZE*16);
+        this->drawn_chunk_count++;
+    }
+    this->paintStats.chunksDrawn++;
+    chunk.pixmap.fill(Qt::transparent);
+    chunk.drawn = true;
+    chunk.incomplete = false;
+    chunk.revision = map->chunk_revision[chunk_y * map->chunks_wide + chunk_x];
+    chunk.asset_revision = this->assetRevision();
+    chunk.animation_tick = this->tilemapTownClient->animation_tick;
+
+    QPainter painter(&chunk.pixmap);
+    int base_x = chunk_x * MAP_CHUNK_SIZE;
+    int base_y = chunk_y * MAP_CHUNK_SIZE;
+    for (int y = 0; y < MAP_CHUNK_SIZE && base_y + y < map->height; y++) {
+        for (int x = 0; x < MAP_CHUNK_SIZE && base_x + x < map->width; x++) {
+            if (!this->drawChunkCell(&painter, base_x + x, base_y + y, x, y))
+                chunk.incomplete = true;
+        }
+    }
+}
+
+void TilemapTownMapView::drawAnimatedCells(MapChunk &chunk, int chunk_x, int chunk_y) {
+    // Only the animated cells in an otherwise up-to-date chunk need to change for a new animation frame
+    TownMap *map = &this->tilemapTownClient->town_map;
+    chunk.animation_tick = this->tilemapTownClient->animation_tick;
+
+    QPainter painter(&chunk.pixmap);
+    for (uint8_t cell : map->chunk_animated_cells[chunk_y * map->chunks_wide + chunk_x]) {
+        int x = cell % MAP_CHUNK_SIZE;
+        int y = cell / MAP_CHUNK_SIZE;
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
+        painter.fillRect(x*16, y*16, 16, 16, Qt::transparent);
+        painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+        if (!this->drawChunkCell(&painter, chunk_x * MAP_CHUNK_SIZE + x, chunk_y * MAP_CHUNK_SIZE + y, x, y))
+            chunk.incomplete = true;
+    }
+}
+
+void TilemapTownMapView::dropChunkCache() {
+    this->chunks.clear();
+    this->drawn_chunk_count = 0;
+}
+
+void TilemapTownMapView::freeChunksOutside(int chunk_x1, int chunk_y1, int chunk_x2, int chunk_y2) {
+    int chunks_wide = this->tilemapTownClient->town_map.chunks_wide;
+    for (size_t i = 0; i < this->chunks.size(); i++) {
+        MapChunk &chunk = this->chunks[i];
+        int chunk_x = i % chunks_wide;
+        int chunk_y = i / chunks_wide;
+        if (!chunk.drawn || (chunk_x >= chunk_x1 && chunk_x <= chunk_x2 && chunk_y >= chunk_y1 && chunk_y <= chunk_y2))
+            continue;
+        chunk = MapChunk();
+        this->drawn_chunk_count--;
     }
 }
 
-void TilemapTownMapView::paintEvent(QPaintEvent *)
+bool TilemapTownMapView::cameraPosition(int &pixelCameraX, int &pixelCameraY) {
+    Entity *me = this->tilemapTownClient->your_entity();
+    if (!me)
+        return false;
+    this->tilemapTownClient->camera_x = me->x * 16 + 8 + me->slide_x;
+    this->tilemapTownClient->camera_y = me->y * 16 + 8 + me->slide_y;
+    pixelCameraX = round(this->tilemapTownClient->camera_x * this->scale - this->width() / 2);
+    pixelCameraY = round(this->tilemapTownClient->camera_y * this->scale - this->height() / 2);
+    return true;
+}
+
+void TilemapTownMapView::updateDirtyAreas() {
+    TilemapTownClient *client = this->tilemapTownClient;
+    if (client == nullptr)
+        return;
+
+    int pixelCameraX = 0, pixelCameraY = 0;
+    bool everything = client->dirty_everything || !client->map_received
+        || !this->cameraPosition(pixelCameraX, pixelCameraY)
+        || pixelCameraX != this->paintedCameraX || pixelCameraY != this->paintedCameraY
+        || this->scale != this->paintedScale
+        || this->assetRevision() != this->paintedAssetRevision
+        || client->town_map.generation != this->chunks_map_generation;
+
+    if (everything) {
+        this->invalidateAll();
+    } else {
+        this->invalidationsReceived++;
+        if (!this->pendingEverything) {
+            int cellPixels = 16 * this->scale;
+            for (const MapRect &rect : client->dirty_cells) {
+                this->pendingRegion += QRect(rect.x1 * cellPixels - pixelCameraX, rect.y1 * cellPixels - pixelCameraY,
+                                             (rect.x2 - rect.x1 + 1) * cellPixels, (rect.y2 - rect.y1 + 1) * cellPixels);
+            }
+        }
+        this->scheduleFrame();
+    }
+    client->dirty_cells.clear();
+    client->dirty_everything = false;
+    this->wakeSimulation();
+
+    // Once a new map's contents arrive, drop downloads for the old one and queue up everything the new one uses
+    if (client->map_received && client->http && client->town_map.generation != this->requestedMapGeneration) {
+        this->requestedMapGeneration = client->town_map.generation;
+        std::unordered_set<std::string> urls;
+        client->collect_image_urls(urls);
+        client->http->begin_map(urls);
+    }
+}
+
+void TilemapTownMapView::paintEvent(QPaintEvent *event)
 {
     if (this->tilemapTownClient == nullptr || !this->tilemapTownClient->map_received)
         return;
-    Entity *me = this->tilemapTownClient->your_entity();
-    if (!me)
+    int pixelCameraX, pixelCameraY;
+    if (!this->cameraPosition(pixelCameraX, pixelCameraY))
         return;
-    this->tilemapTownClient->camera_x = me->x * 16 + 8;
-    this->tilemapTownClient->camera_y = me->y * 16 + 8;
+    this->framesPainted++;
+    this->sinceLastFrame.restart();
+    this->paintedCameraX = pixelCameraX;
+    this->paintedCameraY = pixelCameraY;
+    this->paintedScale = this->scale;
+    this->paintedAssetRevision = this->assetRevision();
+
+    // Only the part Qt asked for gets drawn
+    QRect dirty = event->rect();
 
     int viewWidthPixels = this->width();
     int viewHeightPixels = this->height();
     int viewWidthTiles = floor(viewWidthPixels / (16 * this->scale));
     int viewHeightTiles = floor(viewHeightPixels / (16 * this->scale));
-    int pixelCameraX = round(this->tilemapTownClient->camera_x * this->scale - viewWidthPixels / 2);
-    int pixelCameraY = round(this->tilemapTownClient->camera_y * this->scale - viewHeightPixels / 2);
 
     int offsetX = positive_modulo(pixelCameraX, 16*this->scale);
     int offsetY = positive_modulo(pixelCameraY, 16*this->scale);
     int tileX = floor(pixelCameraX / (16.0 * this->scale));
     int tileY = floor(pixelCameraY / (16.0 * this->scale));
 
+    QElapsedTimer phaseTimer;
+    phaseTimer.start();
+    qint64 mapDone = 0, entitiesDone = 0;
+
     QPainter painter(this);
     {
         QPainterStateGuard guard(&painter);
@@ -98,70 +406,97 @@ void TilemapTownMapView::paintEvent(QPaintEvent *)
         // Display map, and non-"over" objects
         ///////////////////////////////////////////////////////////////////////
 
-        for (int y = 0; y < (viewHeightTiles + 2); y++) {
-            for (int x = 0; x < (viewWidthTiles + 2); x++) {
-                int mapCoordX = x + tileX;
-                int mapCoordY = y + tileY;
+        TownMap *map = &this->tilemapTownClient->town_map;
+        // Chunks drawn with an image that has since been replaced by a newer copy need to be drawn again too
+        uint32_t replacedRevision = this->tilemapTownClient->http ? this->tilemapTownClient->http->replaced_revision : 0;
+        if (this->chunks_map_generation != map->generation || this->chunks.size() != map->chunk_revision.size()
+            || this->chunks_replaced_revision != replacedRevision) {
+            this->chunks.clear();
+            this->chunks.resize(map->chunk_revision.size());
+            this->chunks_map_generation = map->generation;
+            this->chunks_replaced_revision = replacedRevision;
+            this->drawn_chunk_count = 0;
+        }
 
-                if(mapCoordX < 0 || mapCoordY < 0
-                    || mapCoordX >= this->tilemapTownClient->town_map.width
-                    || mapCoordY >= this->tilemapTownClient->town_map.height)
-                    continue;
+        int chunkPixels = MAP_CHUNK_SIZE*16*this->scale;
+        int chunkX1 = std::max((int)floor(pixelCameraX / (double)chunkPixels), 0);
+        int chunkY1 = std::max((int)floor(pixelCameraY / (double)chunkPixels), 0);
+        int chunkX2 = std::min((int)floor((pixelCameraX + viewWidthPixels - 1) / (double)chunkPixels), map->chunks_wide - 1);
+        int chunkY2 = std::min((int)floor((pixelCameraY + viewHeightPixels - 1) / (double)chunkPixels), map->chunks_tall - 1);
+        int dirtyChunkX1 = std::max((int)floor((pixelCameraX + dirty.left()) / (double)chunkPixels), chunkX1);
+        int dirtyChunkY1 = std::max((int)floor((pixelCameraY + dirty.top()) / (double)chunkPixels), chunkY1);
+        int dirtyChunkX2 = std::min((int)floor((pixelCameraX + dirty.right()) / (double)chunkPixels), chunkX2);
+        int dirtyChunkY2 = std::min((int)floor((pixelCameraY + dirty.bottom()) / (double)chunkPixels), chunkY2);
+        uint32_t assetRevision = this->assetRevision();
 
-                struct MapCell &cell = this->tilemapTownClient->town_map.cells[mapCoordY * this->tilemapTownClient->town_map.width + mapCoordX];
-                MapTileInfo *turf = cell.turf.get(this->tilemapTownClient);
-                if (turf) {
-                    this->drawMapTile(&painter, turf, false, mapCoordX, mapCoordY,
-                        x*16*this->scale-offsetX, y*16*this->scale-offsetY, this->scale);
-                }
-                for (struct MapTileReference &tile : cell.objs) {
-                    MapTileInfo *obj = tile.get(this->tilemapTownClient);
-                    if (obj && !obj->over) {
-                        this->drawMapTile(&painter, obj, true, mapCoordX, mapCoordY,
-                            x*16*this->scale-offsetX, y*16*this->scale-offsetY, this->scale);
-                    }
+        for (int chunkY = dirtyChunkY1; chunkY <= dirtyChunkY2; chunkY++) {
+            for (int chunkX = dirtyChunkX1; chunkX <= dirtyChunkX2; chunkX++) {
+                int chunkIndex = chunkY * map->chunks_wide + chunkX;
+                MapChunk &chunk = this->chunks[chunkIndex];
+                if (!chunk.drawn || chunk.revision != map->chunk_revision[chunkIndex]
+                    || (chunk.incomplete && chunk.asset_revision != assetRevision)) {
+                    this->drawMapChunk(chunk, chunkX, chunkY);
+                } else if (chunk.animation_tick != this->tilemapTownClient->animation_tick && !map->chunk_animated_cells[chunkIndex].empty()) {
+                    this->drawAnimatedCells(chunk, chunkX, chunkY);
                 }
+                painter.drawPixmap(QRect(chunkX*chunkPixels - pixelCameraX, chunkY*chunkPixels - pixelCameraY, chunkPixels, chunkPixels),
+                    chunk.pixmap, QRect(0, 0, MAP_CHUNK_SIZE*16, MAP_CHUNK_SIZE*16));
             }
         }
+        if (this->drawn_chunk_count > MAX_CACHED_CHUNKS)
+            this->freeChunksOutside(chunkX1 - 1, chunkY1 - 1, chunkX2 + 1, chunkY2 + 1);
+        mapDone = phaseTimer.nsecsElapsed();
 
         ///////////////////////////////////////////////////////////////////////
         // Display entities
         ///////////////////////////////////////////////////////////////////////
 
-        std::vector<Entity*> sorted_entities;
-        for(auto& [key, entity] : this->tilemapTownClient->who) {
-            sorted_entities.push_back(&entity);
-        }
-        std::sort(sorted_entities.begin(), sorted_entities.end(), sort_entity_by_y_pos);
-
-        for(auto& entity : sorted_entities) {
-            //if(entity->walk_timer)
-            //    entity->walk_timer--;
-            if(
-                (entity->x < (tileX - 3)) ||
-                (entity->y < (tileY - 3)) ||
-                (entity->x > (tileX + viewWidthTiles + 3)) ||
-                (entity->y > (tileY + viewHeightTiles + 3))
-                )
-                continue;
-            const QPixmap *pixmap = entity->pic.get_pixmap(this->tilemapTownClient);
-            if(pixmap) {
-                int tileset_width  = pixmap->width();
-                int tileset_height = pixmap->height();
+        std::vector<QPainter::PixmapFragment> &fragments = this->entityFragments;
+        const QPixmap *fragmentPixmap = nullptr;
+        auto flushFragments = [&]() {
+            if (!fragments.empty())
+                painter.drawPixmapFragments(fragments.data(), fragments.size(), *fragmentPixmap);
+            fragments.clear();
+        };
+
+        // Going through the rows top to bottom draws entities further down the map over the ones above them.
+        // Three tiles covers a picture hanging off its cell plus a two tile slide, and offsets can add more.
+        std::vector<std::vector<Entity*>> &entityRows = this->tilemapTownClient->entity_rows;
+        int entityMargin = 3 + (this->tilemapTownClient->entity_offset_limit + 15) / 16;
+        int entityRow1 = std::max(tileY - entityMargin, 0);
+        int entityRow2 = std::min(tileY + viewHeightTiles + entityMargin, (int)entityRows.size() - 1);
+        for (int row = entityRow1; row <= entityRow2; row++) {
+            for (Entity *entity : entityRows[row]) {
+                if(
+                    (entity->x < (tileX - entityMargin)) ||
+                    (entity->y < (tileY - entityMargin)) ||
+                    (entity->x > (tileX + viewWidthTiles + entityMargin)) ||
+                    (entity->y > (tileY + viewHeightTiles + entityMargin))
+                    )
+                    continue;
+                // Big enough for either size of picture
+                QRect entityRect((entity->x*16-8)*this->scale - pixelCameraX + (entity->offset_x + entity->slide_x)*this->scale,
+                                 (entity->y*16-16)*this->scale - pixelCameraY + (entity->offset_y + entity->slide_y)*this->scale,
+                                 32*this->scale, 32*this->scale);
+                if (!dirty.intersects(entityRect))
+                    continue;
+                const PixmapRegion *region = entity->pic.get_pixmap(this->tilemapTownClient, ASSET_PRIORITY_VISIBLE_ENTITY);
+                if (!region)
+                    continue;
+                int tileset_width  = region->rect.width();
+                int tileset_height = region->rect.height();
+                int draw_x, draw_y, size, source_x, source_y;
 
                 if(tileset_width == 16 && tileset_height == 16) {
-                    painter.drawPixmap(
-                        (entity->x*16)*this->scale - pixelCameraX + entity->offset_x*this->scale,
-                        (entity->y*16)*this->scale - pixelCameraY + entity->offset_y*this->scale,
-                        16*scale,
-                        16*scale,
-                        *pixmap,
-                        0*16, 0*16, 16, 16
-                    );
+                    draw_x = entity->x*16;
+                    draw_y = entity->y*16;
+                    size = 16;
+                    source_x = 0;
+                    source_y = 0;
                 } else if(entity->pic.key_is_url()) {
                     int frame_x = 0, frame_y = 0;
-                    bool is_walking = false; //entity->walk_timer != 0;
-                    const int tenth_of_second_counter = 0; // TODO
+                    bool is_walking = entity->walk_timer != 0;
+                    const int tenth_of_second_counter = this->tilemapTownClient->animation_tick;
 
                     switch(tileset_height / 32) { // Directions
                     case 2: frame_y = entity->direction_lr / 4; break;
@@ -175,34 +510,47 @@ void TilemapTownMapView::paintEvent(QPaintEvent *)
                     case 8: frame_x = (is_walking * 4) + ((tenth_of_second_counter/2) & 3); break;
                     }
 
-                    painter.drawPixmap(
-                        (entity->x*16-8)*this->scale - pixelCameraX + entity->offset_x*this->scale,
-                        (entity->y*16-16)*this->scale - pixelCameraY + entity->offset_y*this->scale,
-                        32*scale,
-                        32*scale,
-                        *pixmap,
-                        frame_x*32, frame_y*32, 32, 32
-                        );
+                    draw_x = entity->x*16-8;
+                    draw_y = entity->y*16-16;
+                    size = 32;
+                    source_x = frame_x*32;
+                    source_y = frame_y*32;
                 } else {
-                    painter.drawPixmap(
-                        (entity->x*16)*this->scale - pixelCameraX + entity->offset_x*this->scale,
-                        (entity->y*16)*this->scale - pixelCameraY + entity->offset_y*this->scale,
-                        16*scale,
-                        16*scale,
-                        *pixmap,
-                        entity->pic.x*16, entity->pic.y*16, 16, 16
-                        );
+                    draw_x = entity->x*16;
+                    draw_y = entity->y*16;
+                    size = 16;
+                    source_x = entity->pic.x*16;
+                    source_y = entity->pic.y*16;
                 }
 
+                // Entities next to each other in drawing order often share an atlas page, so draw them in one call
+                if (region->pixmap != fragmentPixmap) {
+                    flushFragments();
+                    fragmentPixmap = region->pixmap;
+                }
+                double halfSize = size * this->scale / 2.0;
+                fragments.push_back(QPainter::PixmapFragment::create(
+                    QPointF(draw_x*this->scale - pixelCameraX + (entity->offset_x + entity->slide_x)*this->scale + halfSize,
+                            draw_y*this->scale - pixelCameraY + (entity->offset_y + entity->slide_y)*this->scale + halfSize),
+                    QRectF(region->rect.x() + source_x, region->rect.y() + source_y, size, size),
+                    this->scale, this->scale));
+                this->paintStats.entitiesDrawn++;
             }
         }
+        flushFragments();
+        entitiesDone = phaseTimer.nsecsElapsed();
 
         ///////////////////////////////////////////////////////////////////////
         // Display only "over" objects
         ///////////////////////////////////////////////////////////////////////
 
-        for (int y = 0; y < (viewHeightTiles + 2); y++) {
-            for (int x = 0; x < (viewWidthTiles + 2); x++) {
+        int cellPixels = 16*this->scale;
+        int dirtyX1 = std::max((dirty.left() + offsetX) / cellPixels, 0);
+        int dirtyY1 = std::max((dirty.top() + offsetY) / cellPixels, 0);
+        int dirtyX2 = std::min((dirty.right() + offsetX) / cellPixels, viewWidthTiles + 1);
+        int dirtyY2 = std::min((dirty.bottom() + offsetY) / cellPixels, viewHeightTiles + 1);
+        for (int y = dirtyY1; y <= dirtyY2; y++) {
+            for (int x = dirtyX1; x <= dirtyX2; x++) {
                 int mapCoordX = x + tileX;
                 int mapCoordY = y + tileY;
 
@@ -211,17 +559,21 @@ void TilemapTownMapView::paintEvent(QPaintEvent *)
                     || mapCoordY >= this->tilemapTownClient->town_map.height)
                     continue;
 
-                struct MapCell &cell = this->tilemapTownClient->town_map.cells[mapCoordY * this->tilemapTownClient->town_map.width + mapCoordX];
-                for (struct MapTileReference &tile : cell.objs) {
-                    MapTileInfo *obj = tile.get(this->tilemapTownClient);
+                int index = mapCoordY * map->width + mapCoordX;
+                uint32_t objStart = map->obj_start[index];
+                for (int i = 0; i < map->obj_count[index]; i++) {
+                    MapTileInfo *obj = this->tilemapTownClient->tiles.get(map->obj_pool[objStart + i]);
                     if (obj && obj->over) {
-                        this->drawMapTile(&painter, obj, true, mapCoordX, mapCoordY,
+                        this->drawMapTile(&painter, obj, map->obj_pool_autotile[objStart + i],
                                           x*16*this->scale-offsetX, y*16*this->scale-offsetY, this->scale);
                     }
                 }
             }
         }
     }
+    this->paintStats.mapNanoseconds += mapDone;
+    this->paintStats.entityNanoseconds += entitiesDone - mapDone;
+    this->paintStats.overNanoseconds += phaseTimer.nsecsElapsed() - entitiesDone;
 }
 
 void resetSignFlag(TilemapTownClient *client, QKeyEvent *event) {
@@ -248,7 +600,7 @@ void TilemapTownMapView::keyPressEvent(QKeyEvent* event) {
         }
         event->accept();
         emit this->movedPlayer();
-        this->update();
+        this->invalidateAll();
         break;
     case Qt::Key_Right:
     case Qt::Key_D:
@@ -262,7 +614,7 @@ void TilemapTownMapView::keyPressEvent(QKeyEvent* event) {
         }
         event->accept();
         emit this->movedPlayer();
-        this->update();
+        this->invalidateAll();
         break;
     case Qt::Key_Up:
     case Qt::Key_W:
@@ -276,7 +628,7 @@ void TilemapTownMapView::keyPressEvent(QKeyEvent* event) {
         }
         event->accept();
         emit this->movedPlayer();
-        this->update();
+        this->invalidateAll();
         break;
     case Qt::Key_Down:
     case Qt::Key_S:
@@ -290,7 +642,7 @@ void TilemapTownMapView::keyPressEvent(QKeyEvent* event) {
         }
         event->accept();
         emit this->movedPlayer();
-        this->update();
+        this->invalidateAll();
         break;
     case Qt::Key_PageUp:
         resetSignFlag(this->tilemapTownClient, event);
@@ -303,7 +655,7 @@ void TilemapTownMapView::keyPressEvent(QKeyEvent* event) {
         }
         event->accept();
         emit this->movedPlayer();
-        this->update();
+        this->invalidateAll();
         break;
     case Qt::Key_PageDown:
         resetSignFlag(this->tilemapTownClient, event);
@@ -316,7 +668,7 @@ void TilemapTownMapView::keyPressEvent(QKeyEvent* event) {
         }
         event->accept();
         emit this->movedPlayer();
-        this->update();
+        this->invalidateAll();
         break;
     case Qt::Key_End:
         resetSignFlag(this->tilemapTownClient, event);
@@ -329,7 +681,7 @@ void TilemapTownMapView::keyPressEvent(QKeyEvent* event) {
         }
         event->accept();
         emit this->movedPlayer();
-        this->update();
+        this->invalidateAll();
         break;
     case Qt::Key_Home:
         resetSignFlag(this->tilemapTownClient, event);
@@ -342,7 +694,7 @@ void TilemapTownMapView::keyPressEvent(QKeyEvent* event) {
         }
         event->accept();
         emit this->movedPlayer();
-        this->update();
+        this->invalidateAll();
         break;
     case Qt::Key_Return:
     case Qt::Key_Enter:
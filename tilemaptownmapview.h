@@ -20,6 +20,11 @@
 #define TILEMAPTOWNMAPVIEW_H
 
 #include <QWidget>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QRegion>
+#include <QPainter>
+#include <QPixmap>
 #include "town.h"
 
 class TilemapTownMapView : public QWidget
@@ -30,11 +35,78 @@ public:
     TilemapTownClient *tilemapTownClient;
     int scale = 2;
 
+    void updateDirtyAreas(); // Repaints what the client marked as changed, or everything if the view needs it
+    void invalidateAll();    // Repaints everything on the next frame
+
+    // Repaints are held until the next frame, so everything that changes within a frame gets painted together.
+    // 0 means on demand: repaint as soon as something changes, without waiting for a frame.
+    void setFrameRateCap(int fps);
+    void setTileAnimation(bool enabled);
+
+    // Statistics
+    uint64_t invalidationsReceived = 0;
+    uint64_t framesPainted = 0;
+    struct PaintStats {
+        qint64 mapNanoseconds = 0;    // Turf and non-"over" objects, including redrawing chunks
+        qint64 entityNanoseconds = 0;
+        qint64 overNanoseconds = 0;   // "Over" objects
+        uint64_t tilesDrawn = 0;
+        uint64_t chunksDrawn = 0;
+        uint64_t entitiesDrawn = 0;
+    } paintStats; // Added to by every paint
+    void dropChunkCache(); // Makes the next paint draw every chunk from scratch
 protected:
     void paintEvent(QPaintEvent *event) override;
     void keyPressEvent(QKeyEvent* event) override;
 private:
-    void drawMapTile(QPainter *painter, const MapTileInfo *tiletile, bool obj, int map_x, int map_y, float draw_x, float draw_y, int scale);
+    // The turf and non-"over" objects get drawn into chunks that are reused until something in them changes
+    struct MapChunk {
+        QPixmap pixmap;
+        uint32_t revision = 0;       // TownMap::chunk_revision when the chunk was drawn
+        uint32_t asset_revision = 0; // assetRevision() when the chunk was drawn
+        bool drawn = false;
+        bool incomplete = false;     // Some tile or image wasn't available yet, so try again when new assets arrive
+        int animation_tick = 0;      // TilemapTownClient::animation_tick when the animated cells were drawn
+    };
+    std::vector<MapChunk> chunks;
+    uint32_t chunks_map_generation = 0;
+    uint32_t chunks_replaced_revision = 0; // TownFileCache::replaced_revision when the chunks were last dropped
+    int drawn_chunk_count = 0;
+    uint32_t requestedMapGeneration = 0; // Map that TownFileCache::begin_map() was last called for
+    std::vector<QPainter::PixmapFragment> entityFragments; // Reused by paintEvent() to draw entities in batches
+
+    // What the last paint was based on, so updateDirtyAreas() knows when only parts of the view need repainting
+    int paintedCameraX = 0, paintedCameraY = 0;
+    int paintedScale = 0;
+    uint32_t paintedAssetRevision = 0;
+
+    // Render scheduling
+    int frameRateCap = 60;
+    QTimer frameTimer;
+    QElapsedTimer sinceLastFrame;
+    QRegion pendingRegion;
+    bool pendingEverything = false;
+    void scheduleFrame();
+    void flushInvalidations();
+
+    // Animated tiles advance ten times a second
+    QTimer animationTimer;
+    void animationTick();
+
+    // Fixed-step simulation for walking entities
+    QTimer simulationTimer;
+    QElapsedTimer simulationClock;
+    qint64 simulationStepsRun = 0;
+    void wakeSimulation();
+    void simulationTick();
+
+    uint32_t assetRevision();
+    bool cameraPosition(int &pixelCameraX, int &pixelCameraY);
+    bool drawChunkCell(QPainter *painter, int map_x, int map_y, int x, int y);
+    void drawMapChunk(MapChunk &chunk, int chunk_x, int chunk_y);
+    void drawAnimatedCells(MapChunk &chunk, int chunk_x, int chunk_y);
+    void freeChunksOutside(int chunk_x1, int chunk_y1, int chunk_x2, int chunk_y2);
+    bool drawMapTile(QPainter *painter, const MapTileInfo *tile, uint8_t autotile_neighbors, float draw_x, float draw_y, int scale);
 signals:
     void focusChat();
     void movedPlayer();
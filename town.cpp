@@ -18,6 +18,10 @@
  */
 #include "town.h"
 #include "cJSON.h"
+#include <algorithm>
+#ifdef USING_QT
+#include <QElapsedTimer>
+#endif
 
 void html_encode(std::string& out, const char *in);
 
@@ -26,77 +30,312 @@ using namespace std;
 void TownMap::init_map(int width, int height) {
     this->width = width;
     this->height = height;
-    this->cells.clear();
-    this->cells.resize(width * height);
+
+    this->turf.assign(width * height, 0);
+    this->turf_autotile.assign(width * height, 0);
+    this->obj_start.assign(width * height, 0);
+    this->obj_count.assign(width * height, 0);
+    this->obj_pool.clear();
+    this->obj_pool_autotile.clear();
+    this->obj_pool_unused = 0;
+    this->cell_walls.assign(width * height, 0);
+    this->cell_flags.assign(width * height, 0);
+
+    this->generation++;
+    this->chunks_wide = (width + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE;
+    this->chunks_tall = (height + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE;
+    this->chunk_revision.assign(this->chunks_wide * this->chunks_tall, 0);
+    this->chunk_animated_cells.assign(this->chunks_wide * this->chunks_tall, {});
+}
+
+void TownMap::touch_cells(int x1, int y1, int x2, int y2) {
+    // Autotiled cells depend on their neighbors, so the neighbors need to be redrawn too
+    x1 = std::max(x1 - 1, 0);
+    y1 = std::max(y1 - 1, 0);
+    x2 = std::min(x2 + 1, this->width - 1);
+    y2 = std::min(y2 + 1, this->height - 1);
+    if(x1 > x2 || y1 > y2)
+        return;
+
+    for(int chunk_y = y1 / MAP_CHUNK_SIZE; chunk_y <= y2 / MAP_CHUNK_SIZE; chunk_y++) {
+        for(int chunk_x = x1 / MAP_CHUNK_SIZE; chunk_x <= x2 / MAP_CHUNK_SIZE; chunk_x++) {
+            this->chunk_revision[chunk_y * this->chunks_wide + chunk_x]++;
+        }
+    }
+}
+
+void TownMap::set_objs(int index, const MapTileID *objs, int count) {
+    // 'objs' must not point into obj_pool, because obj_pool may be reallocated
+    if(count <= this->obj_count[index]) {
+        // Reuse the cell's existing span
+        this->obj_pool_unused += this->obj_count[index] - count;
+    } else {
+        this->obj_pool_unused += this->obj_count[index];
+        this->obj_start[index] = this->obj_pool.size();
+        this->obj_pool.resize(this->obj_pool.size() + count);
+        this->obj_pool_autotile.resize(this->obj_pool.size());
+    }
+    this->obj_count[index] = count;
+    std::copy(objs, objs + count, this->obj_pool.begin() + this->obj_start[index]);
+
+    if(this->obj_pool_unused > 1024 && this->obj_pool_unused > this->obj_pool.size() / 2)
+        this->compact_objs();
+}
+
+void TownMap::compact_objs() {
+    std::vector<MapTileID> new_pool;
+    std::vector<uint8_t> new_pool_autotile;
+    new_pool.reserve(this->obj_pool.size() - this->obj_pool_unused);
+    new_pool_autotile.reserve(this->obj_pool.size() - this->obj_pool_unused);
+
+    for(size_t index=0; index<this->obj_start.size(); index++) {
+        uint32_t start = this->obj_start[index];
+        uint16_t count = this->obj_count[index];
+        this->obj_start[index] = new_pool.size();
+        new_pool.insert(new_pool.end(), this->obj_pool.begin() + start, this->obj_pool.begin() + start + count);
+        new_pool_autotile.insert(new_pool_autotile.end(), this->obj_pool_autotile.begin() + start, this->obj_pool_autotile.begin() + start + count);
+    }
+    this->obj_pool = std::move(new_pool);
+    this->obj_pool_autotile = std::move(new_pool_autotile);
+    this->obj_pool_unused = 0;
 }
 
 // .-------------------------------------------------------
 // | Map tile functions
 // '-------------------------------------------------------
 
-std::shared_ptr<MapTileInfo> TilemapTownClient::get_shared_pointer_to_tile(MapTileInfo *tile) {
-    std::size_t hash = tile->hash();
-    std::shared_ptr<MapTileInfo> ptr;
+TileRegistry::TileRegistry() {
+    this->epoch = 0;
+    this->new_slot(); // MapTileID 0 is always empty
+}
+
+MapTileID TileRegistry::new_slot() {
+    if(!this->free_slots.empty()) {
+        uint32_t index = this->free_slots.back();
+        this->free_slots.pop_back();
+        Slot &slot = this->entries[index];
+        slot.id += MAP_TILE_ID_INDEX_MASK + 1; // Bump the generation
+        return slot.id;
+    }
+    Slot slot = {};
+    slot.id = this->entries.size();
+    this->entries.push_back(slot);
+    return slot.id;
+}
+
+MapTileID TileRegistry::intern_key(const std::string &key) {
+    auto it = this->id_for_key.find(key);
+    if(it != this->id_for_key.end())
+        return (*it).second;
+
+    // Reserve a slot now, and define() will fill it in if the tile shows up later
+    MapTileID id = this->new_slot();
+    Slot &slot = this->entries[id & MAP_TILE_ID_INDEX_MASK];
+    slot.info = MapTileInfo();
+    slot.defined = false;
+    slot.from_json = false;
+    this->id_for_key[key] = id;
+    return id;
+}
 
-    // Look for it in the JSON tileset
-    auto it = this->json_tileset.find(hash);
-    if(it != this->json_tileset.end()) {
-        ptr = (*it).second.lock();
-        if(ptr)
-            return ptr;
+MapTileID TileRegistry::intern_info(const MapTileInfo &info) {
+    std::size_t hash = info.hash();
+    auto it = this->id_for_hash.find(hash);
+    if(it != this->id_for_hash.end()) {
+        this->entries[(*it).second & MAP_TILE_ID_INDEX_MASK].last_epoch = this->epoch;
+        return (*it).second;
     }
 
-    // Not found, so cache it for later
-    ptr = make_shared<MapTileInfo>(*tile);
-    this->json_tileset[hash] = ptr;
-    return ptr;
+    MapTileID id = this->new_slot();
+    Slot &slot = this->entries[id & MAP_TILE_ID_INDEX_MASK];
+    slot.info = info;
+    slot.defined = true;
+    slot.from_json = true;
+    slot.hash = hash;
+    slot.last_epoch = this->epoch;
+    this->id_for_hash[hash] = id;
+    return id;
+}
+
+MapTileID TileRegistry::define(const std::string &key, const MapTileInfo &info) {
+    // Existing IDs for this key stay valid and now point at the new definition
+    MapTileID id = this->intern_key(key);
+    Slot &slot = this->entries[id & MAP_TILE_ID_INDEX_MASK];
+    slot.info = info;
+    slot.defined = true;
+    return id;
+}
+
+void TileRegistry::begin_epoch() {
+    // Reclaim custom tiles that haven't been used by this map or the previous one
+    this->epoch++;
+    for(uint32_t index = 1; index < this->entries.size(); index++) {
+        Slot &slot = this->entries[index];
+        if(!slot.from_json || !slot.defined || slot.last_epoch + 1 >= this->epoch)
+            continue;
+        this->id_for_hash.erase(slot.hash);
+        slot.info = MapTileInfo();
+        slot.defined = false;
+        slot.from_json = false;
+        this->free_slots.push_back(index);
+    }
 }
 
-MapTileInfo* MapTileReference::get(TilemapTownClient *client) {
-    // If there's a pointer to the tile already, just return that tile
-    if(const auto ptr = std::get_if<std::shared_ptr<MapTileInfo>>(&this->tile)) {
-        return (*ptr).get();
+void TilemapTownClient::map_cells_changed(int x1, int y1, int x2, int y2) {
+    if(this->in_batch) {
+        // Wait for the end of the batch so that cells changed several times are only processed once
+        add_map_rect(this->batch_changed_cells, MapRect{x1, y1, x2, y2});
+        return;
     }
+    this->refresh_cells(x1, y1, x2, y2);
+}
+
+void TilemapTownClient::tiles_changed(const std::unordered_set<MapTileID> &ids) {
+    TownMap *map = &this->town_map;
+    if(ids.empty() || !map->width || !map->height)
+        return;
 
-    // Is the tile available yet?
-    if(const auto str = std::get_if<std::string>(&this->tile)) {
-        // Is it in the client's tileset?
-        auto it = client->tileset.find(*str);
-        if(it != client->tileset.end()) {
-            // Keep the reference to avoid needing to look it up next time
-            this->tile = (*it).second;
-            return (*it).second.get();
+    // Refresh the cells using any of these tiles a chunk at a time, instead of the whole map
+    std::vector<MapRect> chunk_rects(map->chunk_revision.size(), MapRect{map->width, map->height, -1, -1});
+    for(int y = 0; y < map->height; y++) {
+        for(int x = 0; x < map->width; x++) {
+            int index = y * map->width + x;
+            bool uses_tile = ids.find(map->turf[index]) != ids.end();
+            for(int i=0; !uses_tile && i<map->obj_count[index]; i++)
+                uses_tile = ids.find(map->obj_pool[map->obj_start[index] + i]) != ids.end();
+            if(!uses_tile)
+                continue;
+            MapRect &rect = chunk_rects[(y / MAP_CHUNK_SIZE) * map->chunks_wide + x / MAP_CHUNK_SIZE];
+            rect.x1 = std::min(rect.x1, x);
+            rect.y1 = std::min(rect.y1, y);
+            rect.x2 = std::max(rect.x2, x);
+            rect.y2 = std::max(rect.y2, y);
         }
     }
+    // refresh_cells() takes care of the neighbors, whose autotiling may depend on these cells
+    for(const MapRect &rect : chunk_rects) {
+        if(rect.x2 >= 0)
+            this->map_cells_changed(rect.x1, rect.y1, rect.x2, rect.y2);
+    }
+}
 
-    return nullptr;
+void TilemapTownClient::refresh_cells(int x1, int y1, int x2, int y2) {
+    this->town_map.touch_cells(x1, y1, x2, y2);
+    this->update_autotile_neighbors(x1, y1, x2, y2);
+    this->update_animated_cells(x1, y1, x2, y2);
+    this->update_collision(x1, y1, x2, y2);
+    // Autotiling can change the neighbors too
+    this->mark_dirty(MapRect{x1-1, y1-1, x2+1, y2+1});
 }
 
-MapTileReference::MapTileReference(std::string str, TilemapTownClient *client) {
-    // Is it in the client's tileset?
-    auto it = client->tileset.find(str);
-    if(it != client->tileset.end()) {
-        this->tile = (*it).second;
+static bool is_tile_animated(const MapTileInfo *tile) {
+    return tile && tile->animation_frames > 1;
+}
+
+void TilemapTownClient::update_animated_cells(int x1, int y1, int x2, int y2) {
+    TownMap *map = &this->town_map;
+    x1 = std::max(x1, 0);
+    y1 = std::max(y1, 0);
+    x2 = std::min(x2, map->width - 1);
+    y2 = std::min(y2, map->height - 1);
+    if(x1 > x2 || y1 > y2)
         return;
+
+    // Scanning a whole chunk is cheap, and it's simpler than adding and removing single cells
+    for(int chunk_y = y1 / MAP_CHUNK_SIZE; chunk_y <= y2 / MAP_CHUNK_SIZE; chunk_y++) {
+        for(int chunk_x = x1 / MAP_CHUNK_SIZE; chunk_x <= x2 / MAP_CHUNK_SIZE; chunk_x++) {
+            std::vector<uint8_t> &animated = map->chunk_animated_cells[chunk_y * map->chunks_wide + chunk_x];
+            animated.clear();
+            int base_x = chunk_x * MAP_CHUNK_SIZE;
+            int base_y = chunk_y * MAP_CHUNK_SIZE;
+            for(int y = 0; y < MAP_CHUNK_SIZE && base_y + y < map->height; y++) {
+                for(int x = 0; x < MAP_CHUNK_SIZE && base_x + x < map->width; x++) {
+                    int index = (base_y + y) * map->width + base_x + x;
+                    bool is_animated = is_tile_animated(this->tiles.get(map->turf[index]));
+                    uint32_t start = map->obj_start[index];
+                    for(int i=0; i<map->obj_count[index] && !is_animated; i++)
+                        is_animated = is_tile_animated(this->tiles.get(map->obj_pool[start + i]));
+                    if(is_animated)
+                        animated.push_back(y * MAP_CHUNK_SIZE + x);
+                }
+            }
+            if(animated.empty())
+                animated.shrink_to_fit();
+        }
     }
-    // Otherwise, just store the string
-    this->tile = str;
 }
 
-MapTileReference::MapTileReference(std::string str) {
-    this->tile = str;
+void TilemapTownClient::update_collision(int x1, int y1, int x2, int y2) {
+    TownMap *map = &this->town_map;
+    x1 = std::max(x1, 0);
+    y1 = std::max(y1, 0);
+    x2 = std::min(x2, map->width - 1);
+    y2 = std::min(y2, map->height - 1);
+
+    for(int y = y1; y <= y2; y++) {
+        for(int x = x1; x <= x2; x++) {
+            int index = y * map->width + x;
+            uint8_t walls = 0, flags = 0;
+            if(const MapTileInfo *turf = this->tiles.get(map->turf[index])) {
+                walls |= turf->walls;
+                if(turf->type == MAP_TILE_SIGN)
+                    flags |= MAP_CELL_HAS_SIGN;
+            }
+            uint32_t start = map->obj_start[index];
+            for(int i=0; i<map->obj_count[index]; i++) {
+                if(const MapTileInfo *obj = this->tiles.get(map->obj_pool[start + i])) {
+                    walls |= obj->walls;
+                    if(obj->type == MAP_TILE_SIGN)
+                        flags |= MAP_CELL_HAS_SIGN;
+                }
+            }
+            map->cell_walls[index] = walls;
+            map->cell_flags[index] = flags;
+        }
+    }
 }
 
-MapTileReference::MapTileReference(std::shared_ptr<MapTileInfo> tile) {
-    this->tile = tile;
+// Past this many separate rectangles, repainting everything is cheaper than keeping track
+#define MAX_DIRTY_RECTS 64
+
+void TilemapTownClient::mark_dirty(MapRect rect) {
+    if(this->dirty_everything)
+        return;
+    add_map_rect(this->dirty_cells, rect);
+    if(this->dirty_cells.size() > MAX_DIRTY_RECTS) {
+        this->dirty_cells.clear();
+        this->dirty_everything = true;
+    }
 }
 
-MapTileReference::MapTileReference(MapTileInfo* tile, TilemapTownClient *client) {
-    this->tile = client->get_shared_pointer_to_tile(tile);
+MapRect Entity::map_rect() const {
+    // 32x32 pictures are drawn 8 pixels left of and 16 pixels above the entity's cell, and 16x16 ones fit inside that
+    int left = this->x*16 - 8 + this->offset_x + this->slide_x;
+    int top  = this->y*16 - 16 + this->offset_y + this->slide_y;
+    // >> rounds down even for negative positions, unlike /
+    return MapRect{left >> 4, top >> 4, (left+31) >> 4, (top+31) >> 4};
 }
 
-MapTileReference::MapTileReference() {
-    this->tile = std::monostate();
+void add_map_rect(std::vector<MapRect> &rects, MapRect rect) {
+    // Keep absorbing rectangles that overlap or touch the new one, since the combined one may now reach others
+    bool merged = true;
+    while(merged) {
+        merged = false;
+        for(size_t i=0; i<rects.size(); i++) {
+            MapRect &other = rects[i];
+            if(other.x1 > rect.x2 + 1 || other.x2 < rect.x1 - 1 || other.y1 > rect.y2 + 1 || other.y2 < rect.y1 - 1)
+                continue;
+            rect.x1 = std::min(rect.x1, other.x1);
+            rect.y1 = std::min(rect.y1, other.y1);
+            rect.x2 = std::max(rect.x2, other.x2);
+            rect.y2 = std::max(rect.y2, other.y2);
+            rects[i] = rects.back();
+            rects.pop_back();
+            merged = true;
+            break;
+        }
+    }
+    rects.push_back(rect);
 }
 
 std::size_t hash_combine(std::size_t a, std::size_t b) {
@@ -144,25 +383,20 @@ bool Pic::key_is_url() const {
     return this->key.starts_with("https://") || this->key.starts_with("http://");
 }
 
-// --------------------------------------------------------
-
-MapCell::MapCell() {
-    this->turf = MapTileReference();
-}
-
-MapCell::MapCell(struct MapTileReference turf) {
-    this->turf = turf;
-}
-
 // .-------------------------------------------------------
 // | Map tile appearance calculation
 // '-------------------------------------------------------
 
-bool TilemapTownClient::is_turf_autotile_match(const MapTileInfo *turf, TownMap *map, int map_x, int map_y) {
+bool TilemapTownClient::is_turf_autotile_match(const MapTileInfo *turf, MapTileID turf_id, TownMap *map, int map_x, int map_y) {
     // Is the turf tile on the map at x,y the "same" as 'turf' for autotiling purposes?
-    if(map_x < 0 || map_x >= this->town_map.width || map_y < 0 || map_y >= this->town_map.height)
+    if(map_x < 0 || map_x >= map->width || map_y < 0 || map_y >= map->height)
         return true;
-    MapTileInfo *other = this->town_map.cells[map_y * this->town_map.width + map_x].turf.get(this);
+    MapTileID other_id = map->turf[map_y * map->width + map_x];
+    if(other_id == turf_id)
+        return turf->autotile_class || !turf->name.empty();
+    MapTileInfo *other = this->tiles.get(other_id);
+    if(!other)
+        return false;
 
     if(turf->autotile_class)
         return turf->autotile_class == other->autotile_class;
@@ -171,13 +405,19 @@ bool TilemapTownClient::is_turf_autotile_match(const MapTileInfo *turf, TownMap
     return false;
 }
 
-bool TilemapTownClient::is_obj_autotile_match(const MapTileInfo *obj, TownMap *map, int map_x, int map_y) {
+bool TilemapTownClient::is_obj_autotile_match(const MapTileInfo *obj, MapTileID obj_id, TownMap *map, int map_x, int map_y) {
     // Is any obj tile on the map at x,y the "same" as 'obj' for autotiling purposes?
-    if(map_x < 0 || map_x >= this->town_map.width || map_y < 0 || map_y >= this->town_map.height)
+    if(map_x < 0 || map_x >= map->width || map_y < 0 || map_y >= map->height)
         return true;
+    if(!obj->autotile_class && obj->name.empty())
+        return false;
 
-    for(auto & element : this->town_map.cells[map_y * this->town_map.width + map_x].objs) {
-        MapTileInfo *other_obj = element.get(this);
+    int index = map_y * map->width + map_x;
+    const MapTileID *objs = &map->obj_pool[map->obj_start[index]];
+    for(int i=0; i<map->obj_count[index]; i++) {
+        if(objs[i] == obj_id)
+            return true;
+        MapTileInfo *other_obj = this->tiles.get(objs[i]);
         if(!other_obj)
             continue;
         if(obj->autotile_class) {
@@ -191,40 +431,29 @@ bool TilemapTownClient::is_obj_autotile_match(const MapTileInfo *obj, TownMap *m
     return false;
 }
 
-unsigned int TilemapTownClient::get_turf_autotile_index_4(const MapTileInfo *turf, TownMap *map, int map_x, int map_y) {
-    /* Check on the four adjacent tiles and see if they "match", to get an index for an autotile lookup table.
-        Will result in one of the following:
-         0 durl  1 durL  2 duRl  3 duRL
-         4 dUrl  5 dUrL  6 dURl  7 dURL
-         8 Durl  9 DurL 10 DuRl 11 DuRL
-        12 DUrl 13 DUrL 14 DURl 15 DURL
-    */
-    return (this->is_turf_autotile_match(turf, map, map_x-1, map_y) << 0)
-           | (this->is_turf_autotile_match(turf, map, map_x+1, map_y) << 1)
-           | (this->is_turf_autotile_match(turf, map, map_x, map_y-1) << 2)
-           | (this->is_turf_autotile_match(turf, map, map_x, map_y+1) << 3);
-}
-
-unsigned int TilemapTownClient::get_obj_autotile_index_4(const MapTileInfo *turf, TownMap *map, int map_x, int map_y) {
-    /* Check on the four adjacent tiles and see if they "match", to get an index for an autotile lookup table.
+uint8_t TilemapTownClient::get_autotile_neighbors(const MapTileInfo *tile, MapTileID tile_id, bool obj, TownMap *map, int map_x, int map_y) {
+    /* Check on the eight surrounding tiles and see if they "match". The lower four bits are an index for an autotile lookup table.
         Will result in one of the following:
          0 durl  1 durL  2 duRl  3 duRL
          4 dUrl  5 dUrL  6 dURl  7 dURL
          8 Durl  9 DurL 10 DuRl 11 DuRL
         12 DUrl 13 DUrL 14 DURl 15 DURL
     */
-    return (this->is_obj_autotile_match(turf, map, map_x-1, map_y) << 0)
-           | (this->is_obj_autotile_match(turf, map, map_x+1, map_y) << 1)
-           | (this->is_obj_autotile_match(turf, map, map_x, map_y-1) << 2)
-           | (this->is_obj_autotile_match(turf, map, map_x, map_y+1) << 3);
+    static const int offset_x[] = {-1, 1,  0, 0, -1,  1, -1, 1};
+    static const int offset_y[] = { 0, 0, -1, 1, -1, -1,  1, 1};
+    if(!tile || tile->autotile_layout == 0)
+        return 0;
+
+    uint8_t neighbors = 0;
+    for(int i=0; i<8; i++) {
+        if(obj ? this->is_obj_autotile_match(tile, tile_id, map, map_x + offset_x[i], map_y + offset_y[i])
+               : this->is_turf_autotile_match(tile, tile_id, map, map_x + offset_x[i], map_y + offset_y[i]))
+            neighbors |= 1 << i;
+    }
+    return neighbors;
 }
 
-bool TilemapTownClient::calc_pic_quarters(int quarter_x[4], int quarter_y[4], const MapTileInfo *tile, bool obj, TownMap *map, int map_x, int map_y, int tenth_of_second_counter) {
-    // Returns false when only quarter_x[0] and quarter_y[0] are used and are in 16x16 units
-    // Returns true when every index is used and quarter_x,quarter_y use 8x8 units
-    if (!tile || !map)
-        return false;
-
+int get_animation_frame(const MapTileInfo *tile, int tenth_of_second_counter) {
     int animation_frame = 0;
     if(tile->animation_frames > 1) {
         int animation_frame_count = tile->animation_frames;
@@ -255,7 +484,12 @@ bool TilemapTownClient::calc_pic_quarters(int quarter_x[4], int quarter_y[4], co
         }
         }
     }
+    return animation_frame;
+}
 
+static bool calc_pic_quarters_for_frame(int quarter_x[4], int quarter_y[4], const MapTileInfo *tile, uint8_t neighbors, int animation_frame) {
+    // Returns false when only quarter_x[0] and quarter_y[0] are used and are in 16x16 units
+    // Returns true when every index is used and quarter_x,quarter_y use 8x8 units
     switch(tile->autotile_layout) {
     default:
     {
@@ -271,8 +505,7 @@ bool TilemapTownClient::calc_pic_quarters(int quarter_x[4], int quarter_y[4], co
     }
     case 1: // 4-direction autotiling, 9 tiles, origin is middle
     {
-        unsigned int autotile_index = obj ? this->get_obj_autotile_index_4(tile, map, map_x, map_y)
-                                          : this->get_turf_autotile_index_4(tile, map, map_x, map_y);
+        unsigned int autotile_index = neighbors & 15;
         const static int offset_x_list[] = {0,0,0,0,   0,1,-1,0,    0, 1,-1, 0,  0,1,-1,0};
         const static int offset_y_list[] = {0,0,0,0,   0,1, 1,1,    0,-1,-1,-1,  0,0, 0,0};
         quarter_x[0] = tile->pic.x + offset_x_list[autotile_index] + animation_frame * 3;
@@ -282,8 +515,7 @@ bool TilemapTownClient::calc_pic_quarters(int quarter_x[4], int quarter_y[4], co
     case 2: // 4-direction autotiling, 9 tiles, origin is middle, horizonal & vertical & single as separate tiles
     case 3: // Same as 2, but origin point is single
     {
-        unsigned int autotile_index = obj ? this->get_obj_autotile_index_4(tile, map, map_x, map_y)
-                                          : this->get_turf_autotile_index_4(tile, map, map_x, map_y);
+        unsigned int autotile_index = neighbors & 15;
         const static int offset_x_list[] = { 2,1,-1,0};
         const static int offset_y_list[] = {-2,1,-1,0};
         bool isThree = tile->autotile_layout == 3;
@@ -295,8 +527,7 @@ bool TilemapTownClient::calc_pic_quarters(int quarter_x[4], int quarter_y[4], co
     case 4: // 8-direction autotiling, origin point is middle
     case 5: // 8-direction autotiling, origin point is single
     {
-        unsigned int autotile_index = obj ? this->get_obj_autotile_index_4(tile, map, map_x, map_y)
-                                          : this->get_turf_autotile_index_4(tile, map, map_x, map_y);
+        unsigned int autotile_index = neighbors & 15;
         const static int offset_0x[] = {-2, 2,-2, 0,-2, 2,-2, 0,-2, 2,-2, 0,-2, 2,-2, 0};
         const static int offset_0y[] = {-4,-2,-2,-2, 2, 2, 2, 2,-2,-2,-2,-2, 0, 0, 0, 0};
         const static int offset_1x[] = {-1, 3,-1, 1, 3, 3,-1, 1, 3, 3,-1, 1, 3, 3,-1, 1};
@@ -313,23 +544,19 @@ bool TilemapTownClient::calc_pic_quarters(int quarter_x[4], int quarter_y[4], co
 
         // Add the inner parts of turns
         if(((autotile_index &  5) ==  5)
-            && !(obj ? this->is_obj_autotile_match(tile, map, map_x-1, map_y-1)
-                     : this->is_turf_autotile_match(tile, map, map_x-1, map_y-1))) {
+            && !(neighbors & AUTOTILE_NW)) {
             quarter_x[0] = 2; quarter_y[0] = -4;
         }
         if(((autotile_index &  6) ==  6)
-            && !(obj ? this->is_obj_autotile_match(tile, map, map_x+1, map_y-1)
-                     : this->is_turf_autotile_match(tile, map, map_x+1, map_y-1))) {
+            && !(neighbors & AUTOTILE_NE)) {
             quarter_x[1] = 3; quarter_y[1] = -4;
         }
         if(((autotile_index &  9) ==  9)
-            && !(obj ? this->is_obj_autotile_match(tile, map, map_x-1, map_y+1)
-                     : this->is_turf_autotile_match(tile, map, map_x-1, map_y+1))) {
+            && !(neighbors & AUTOTILE_SW)) {
             quarter_x[2] = 2; quarter_y[2] = -3;
         }
         if(((autotile_index & 10) == 10)
-            && !(obj ? this->is_obj_autotile_match(tile, map, map_x+1, map_y+1)
-                     : this->is_turf_autotile_match(tile, map, map_x+1, map_y+1))) {
+            && !(neighbors & AUTOTILE_SE)) {
             quarter_x[3] = 3; quarter_y[3] = -3;
         }
 
@@ -352,16 +579,16 @@ bool TilemapTownClient::calc_pic_quarters(int quarter_x[4], int quarter_y[4], co
     }
     case 6: // horizontal - middle 3
     {
-        bool right = obj ? is_obj_autotile_match(tile, map, map_x+1, map_y) : is_turf_autotile_match(tile, map, map_x+1, map_y);
-        bool left = obj ? is_obj_autotile_match(tile, map, map_x-1, map_y) : is_turf_autotile_match(tile, map, map_x-1, map_y);
+        bool right = neighbors & AUTOTILE_E;
+        bool left = neighbors & AUTOTILE_W;
         quarter_x[0] = tile->pic.x - (!left && right) + (left && !right) + animation_frame*3;
         quarter_y[0] = tile->pic.y;
         return false;
     }
     case 7: case 8: // horizontal
     {
-        bool right = obj ? is_obj_autotile_match(tile, map, map_x+1, map_y) : is_turf_autotile_match(tile, map, map_x+1, map_y);
-        bool left = obj ? is_obj_autotile_match(tile, map, map_x-1, map_y) : is_turf_autotile_match(tile, map, map_x-1, map_y);
+        bool right = neighbors & AUTOTILE_E;
+        bool left = neighbors & AUTOTILE_W;
         quarter_x[0] = tile->pic.x - (!left && right) + (left && !right) + animation_frame*3;
         quarter_y[0] = tile->pic.y;
         if(!left && !right) quarter_x[0] += 2;
@@ -370,16 +597,16 @@ bool TilemapTownClient::calc_pic_quarters(int quarter_x[4], int quarter_y[4], co
     }
     case 9: // vertical - middle 3
     {
-        bool bottom = obj ? is_obj_autotile_match(tile, map, map_x, map_y+1) : is_turf_autotile_match(tile, map, map_x, map_y+1);
-        bool top = obj ? is_obj_autotile_match(tile, map, map_x, map_y-1) : is_turf_autotile_match(tile, map, map_x, map_y-1);
+        bool bottom = neighbors & AUTOTILE_S;
+        bool top = neighbors & AUTOTILE_N;
         quarter_x[0] = tile->pic.x + animation_frame;
         quarter_y[0] = tile->pic.y - (!top && bottom) + (top && !bottom);
         return false;
     }
     case 10: case 11: // vertical
     {
-        bool bottom = obj ? is_obj_autotile_match(tile, map, map_x, map_y+1) : is_turf_autotile_match(tile, map, map_x, map_y+1);
-        bool top = obj ? is_obj_autotile_match(tile, map, map_x, map_y-1) : is_turf_autotile_match(tile, map, map_x, map_y-1);
+        bool bottom = neighbors & AUTOTILE_S;
+        bool top = neighbors & AUTOTILE_N;
         quarter_x[0] = tile->pic.x + animation_frame;
         quarter_y[0] = tile->pic.y - (!top && bottom) + (top && !bottom);
         if(!top && !bottom) quarter_y[0] -= 2;
@@ -388,8 +615,7 @@ bool TilemapTownClient::calc_pic_quarters(int quarter_x[4], int quarter_y[4], co
     }
     case 12: case 13: case 14: case 15: // 8-way autotile
     {
-        unsigned int autotile_index = obj ? this->get_obj_autotile_index_4(tile, map, map_x, map_y)
-                                          : this->get_turf_autotile_index_4(tile, map, map_x, map_y);
+        unsigned int autotile_index = neighbors & 15;
         const static uint8_t offsets_8[16][4][2] =
             {{{0, 2},{1, 2},{0, 3},{1, 3}}, {{0, 7},{1, 2},{1, 6},{1, 3}},
              {{0, 2},{0, 7},{0, 3},{1, 6}}, {{0, 7},{0, 7},{1, 6},{1, 6}},
@@ -432,26 +658,22 @@ bool TilemapTownClient::calc_pic_quarters(int quarter_x[4], int quarter_y[4], co
         // Add the inner parts of turns
 
         if(((autotile_index &  5) ==  5)
-            && !(obj ? this->is_obj_autotile_match(tile, map, map_x-1, map_y-1)
-                     : this->is_turf_autotile_match(tile, map, map_x-1, map_y-1))) {
+            && !(neighbors & AUTOTILE_NW)) {
             quarter_x[0] = 0;
             quarter_y[0] = 4;
         }
         if(((autotile_index &  6) ==  6)
-            && !(obj ? this->is_obj_autotile_match(tile, map, map_x+1, map_y-1)
-                     : this->is_turf_autotile_match(tile, map, map_x+1, map_y-1))) {
+            && !(neighbors & AUTOTILE_NE)) {
             quarter_x[1] = 1;
             quarter_y[1] = 4;
         }
         if(((autotile_index &  9) ==  9)
-            && !(obj ? this->is_obj_autotile_match(tile, map, map_x-1, map_y+1)
-                     : this->is_turf_autotile_match(tile, map, map_x-1, map_y+1))) {
+            && !(neighbors & AUTOTILE_SW)) {
             quarter_x[2] = 0;
             quarter_y[2] = 5;
         }
         if(((autotile_index & 10) == 10)
-            && !(obj ? this->is_obj_autotile_match(tile, map, map_x+1, map_y+1)
-                     : this->is_turf_autotile_match(tile, map, map_x+1, map_y+1))) {
+            && !(neighbors & AUTOTILE_SE)) {
             quarter_x[3] = 1;
             quarter_y[3] = 5;
         }
@@ -477,17 +699,289 @@ bool TilemapTownClient::calc_pic_quarters(int quarter_x[4], int quarter_y[4], co
     }
 }
 
+bool TilemapTownClient::calc_pic_quarters(int quarter_x[4], int quarter_y[4], const MapTileInfo *tile, uint8_t neighbors, int tenth_of_second_counter) {
+    if (!tile)
+        return false;
+    return calc_pic_quarters_for_frame(quarter_x, quarter_y, tile, neighbors, get_animation_frame(tile, tenth_of_second_counter));
+}
+
+void TilemapTownClient::update_autotile_neighbors(int x1, int y1, int x2, int y2) {
+    // The cells around the changed area may autotile differently now, so include them too
+    TownMap *map = &this->town_map;
+    x1 = std::max(x1 - 1, 0);
+    y1 = std::max(y1 - 1, 0);
+    x2 = std::min(x2 + 1, map->width - 1);
+    y2 = std::min(y2 + 1, map->height - 1);
+
+    for(int y=y1; y<=y2; y++) {
+        for(int x=x1; x<=x2; x++) {
+            int index = y * map->width + x;
+            MapTileID turf_id = map->turf[index];
+            map->turf_autotile[index] = this->get_autotile_neighbors(this->tiles.get(turf_id), turf_id, false, map, x, y);
+
+            uint32_t start = map->obj_start[index];
+            for(int i=0; i<map->obj_count[index]; i++) {
+                MapTileID obj_id = map->obj_pool[start + i];
+                map->obj_pool_autotile[start + i] = this->get_autotile_neighbors(this->tiles.get(obj_id), obj_id, true, map, x, y);
+            }
+        }
+    }
+}
+
 // .-------------------------------------------------------
-// | Game logic/movement related
+// | Entity list
 // '-------------------------------------------------------
 
-Entity *TilemapTownClient::your_entity() {
-    if(this->your_id.empty())
+EntityList::EntityList() {
+    this->count = 0;
+    // Handle 0 and EntityID 0 are always empty
+    this->entries.push_back(Slot());
+    this->id_strings.push_back("");
+    this->handle_for_id.push_back(0);
+}
+
+EntityID EntityList::intern_id(const std::string &id) {
+    auto it = this->id_for_string.find(id);
+    if(it != this->id_for_string.end())
+        return (*it).second;
+    EntityID interned;
+    if(!this->free_ids.empty()) {
+        interned = this->free_ids.back();
+        this->free_ids.pop_back();
+        this->id_strings[interned] = id;
+    } else {
+        interned = this->id_strings.size();
+        this->id_strings.push_back(id);
+        this->handle_for_id.push_back(0);
+    }
+    this->id_for_string[id] = interned;
+    return interned;
+}
+
+EntityID EntityList::find_id(const std::string &id) const {
+    auto it = this->id_for_string.find(id);
+    if(it != this->id_for_string.end())
+        return (*it).second;
+    return 0;
+}
+
+const std::string &EntityList::id_string(EntityID id) const {
+    return this->id_strings[id < this->id_strings.size() ? id : 0];
+}
+
+void EntityList::release_unused_ids(EntityID keep) {
+    std::vector<bool> used(this->id_strings.size(), false);
+    auto mark = [&](EntityID id) {
+        if(id < used.size())
+            used[id] = true;
+    };
+    mark(keep);
+    for(Slot &slot : this->entries) {
+        if(!slot.used)
+            continue;
+        mark(slot.entity.id);
+        mark(slot.entity.vehicle);
+        for(EntityID passenger : slot.entity.passengers)
+            mark(passenger);
+    }
+
+    for(auto it = this->id_for_string.begin(); it != this->id_for_string.end(); ) {
+        EntityID id = (*it).second;
+        if(used[id]) {
+            ++it;
+            continue;
+        }
+        this->id_strings[id] = std::string();
+        this->free_ids.push_back(id);
+        it = this->id_for_string.erase(it);
+    }
+}
+
+Entity *EntityList::add(EntityID id, const Entity &entity) {
+    if(!id || id >= this->handle_for_id.size())
         return nullptr;
-    auto it = this->who.find(this->your_id);
-    if(it == this->who.end())
+    Entity *existing = this->find(id);
+    if(existing) {
+        *existing = entity;
+        existing->id = id;
+        return existing;
+    }
+
+    uint32_t index;
+    if(!this->free_slots.empty()) {
+        index = this->free_slots.back();
+        this->free_slots.pop_back();
+    } else {
+        index = this->entries.size();
+        Slot slot = Slot();
+        slot.handle = index;
+        this->entries.push_back(slot);
+    }
+    Slot &slot = this->entries[index];
+    slot.entity = entity;
+    slot.entity.id = id;
+    slot.used = true;
+    this->handle_for_id[id] = slot.handle;
+    this->count++;
+    return &slot.entity;
+}
+
+void EntityList::remove(EntityID id) {
+    EntityHandle handle = this->handle_for(id);
+    if(!this->get(handle))
+        return;
+    uint32_t index = handle & ENTITY_HANDLE_INDEX_MASK;
+    Slot &slot = this->entries[index];
+    slot.entity = Entity();
+    slot.used = false;
+    slot.handle += ENTITY_HANDLE_INDEX_MASK + 1; // Bump the generation so old handles stop working
+    this->free_slots.push_back(index);
+    this->handle_for_id[id] = 0;
+    this->count--;
+}
+
+bool EntityList::rename(EntityID id, EntityID new_id) {
+    // The entity keeps its slot, so its handle stays valid under the new ID
+    Entity *entity = this->find(id);
+    if(!entity || !new_id || new_id >= this->handle_for_id.size())
+        return false;
+    if(id == new_id)
+        return true;
+    this->remove(new_id);
+    this->handle_for_id[new_id] = this->handle_for_id[id];
+    this->handle_for_id[id] = 0;
+    entity->id = new_id;
+    return true;
+}
+
+void EntityList::clear() {
+    for(uint32_t index = 1; index < this->entries.size(); index++) {
+        Slot &slot = this->entries[index];
+        if(!slot.used)
+            continue;
+        this->handle_for_id[slot.entity.id] = 0;
+        slot.entity = Entity();
+        slot.used = false;
+        slot.handle += ENTITY_HANDLE_INDEX_MASK + 1;
+        this->free_slots.push_back(index);
+    }
+    this->count = 0;
+}
+
+static void unlink_entity_row(std::vector<std::vector<Entity*>> &rows, Entity *entity) {
+    if(entity->row < 0)
+        return;
+    std::vector<Entity*> &row = rows[entity->row];
+    auto it = std::find(row.begin(), row.end(), entity);
+    if(it != row.end()) {
+        *it = row.back();
+        row.pop_back();
+    }
+    entity->row = -1;
+}
+
+void TilemapTownClient::entity_moved(Entity *entity) {
+    this->entity_offset_limit = std::max({this->entity_offset_limit, std::abs(entity->offset_x), std::abs(entity->offset_y)});
+    if(this->entity_rows.empty())
+        return;
+    // Entities off the edge of the map go in the nearest row
+    int row = std::clamp(entity->y, 0, (int)this->entity_rows.size() - 1);
+    if(row == entity->row)
+        return;
+    unlink_entity_row(this->entity_rows, entity);
+    entity->row = row;
+    this->entity_rows[row].push_back(entity);
+}
+
+void TilemapTownClient::rebuild_entity_rows() {
+    this->entity_rows.clear();
+    this->entity_rows.resize(std::max(this->town_map.height, 0));
+    this->who.for_each([this](Entity &entity) {
+        entity.row = -1;
+        this->entity_moved(&entity);
+    });
+}
+
+Entity *TilemapTownClient::set_entity(EntityID id, const Entity &entity) {
+    Entity *old = this->who.find(id);
+    bool in_moving_list = false;
+    if(old) {
+        unlink_entity_row(this->entity_rows, old);
+        in_moving_list = old->in_moving_list; // The handle stays the same, so it's still in the list
+    }
+    Entity *stored = this->who.add(id, entity);
+    if(!stored)
         return nullptr;
-    return &(*it).second;
+    stored->row = -1;
+    stored->in_moving_list = in_moving_list;
+    this->entity_moved(stored);
+    return stored;
+}
+
+void TilemapTownClient::remove_entity(EntityID id) {
+    Entity *entity = this->who.find(id);
+    if(!entity)
+        return;
+    unlink_entity_row(this->entity_rows, entity);
+    this->who.remove(id);
+}
+
+void TilemapTownClient::rename_entity(EntityID id, EntityID new_id) {
+    // Anything already using the new ID gets replaced
+    if(this->who.find(id) && id != new_id)
+        this->remove_entity(new_id);
+    this->who.rename(id, new_id);
+}
+
+void TilemapTownClient::release_entity_ids() {
+    // Checking which IDs are still used means looking at every entity, so wait until a good share of them are unused
+    if(this->who.id_count() > this->who.size() * 2 + 64)
+        this->who.release_unused_ids(this->your_id);
+}
+
+void TilemapTownClient::clear_entities() {
+    this->who.clear();
+    this->entity_offset_limit = 0;
+    for(std::vector<Entity*> &row : this->entity_rows)
+        row.clear();
+}
+
+void TilemapTownClient::collect_image_urls(std::unordered_set<std::string> &urls) {
+    auto add_pic = [&](const Pic &pic) {
+        if(pic.key_is_url()) {
+            urls.insert(pic.key);
+            return;
+        }
+        auto find_url = this->url_for_tile_sheet.find(pic.key);
+        if(find_url != this->url_for_tile_sheet.end())
+            urls.insert((*find_url).second);
+    };
+
+    // Look up each distinct tile on the map once
+    std::unordered_set<MapTileID> seen_tiles;
+    auto add_tile = [&](MapTileID id) {
+        if(!id || !seen_tiles.insert(id).second)
+            return;
+        MapTileInfo *tile = this->tiles.get(id);
+        if(tile)
+            add_pic(tile->pic);
+    };
+    for(MapTileID id : this->town_map.turf)
+        add_tile(id);
+    for(MapTileID id : this->town_map.obj_pool)
+        add_tile(id);
+
+    this->who.for_each([&](Entity &entity) {
+        add_pic(entity.pic);
+    });
+}
+
+// .-------------------------------------------------------
+// | Game logic/movement related
+// '-------------------------------------------------------
+
+Entity *TilemapTownClient::your_entity() {
+    return this->who.find(this->your_id);
 }
 
 #ifdef __3DS__
@@ -575,87 +1069,90 @@ void TilemapTownClient::move_player(int offset_x, int offset_y) {
     ////////////////////////////
     // Check old tile for walls
     ////////////////////////////
-    MapCell *cell = &this->town_map.cells[original_y * this->town_map.width + original_x];
-
-    MapTileInfo *turf = cell->turf.get(this);
-    if(turf && (turf->walls & (1 << new_direction)) && !this->walk_through_walls) {
+    TownMap *map = &this->town_map;
+    int index = original_y * map->width + original_x;
+
+    if((map->cell_walls[index] & (1 << new_direction)) && !this->walk_through_walls) {
+        // A turf wall replaces the bump position from running into the edge of the map, but an obj wall doesn't
+        const MapTileInfo *turf = this->tiles.get(map->turf[index]);
+        if(!bumped || (turf && (turf->walls & (1 << new_direction)))) {
+            bumped_x = original_x;
+            bumped_y = original_y;
+        }
         // Go back
         bumped = true;
-        bumped_x = original_x;
-        bumped_y = original_y;
         you->x = original_x;
         you->y = original_y;
     }
 
-    for(auto & obj_reference : cell->objs) {
-        MapTileInfo *obj = obj_reference.get(this);
-        if(!obj)
-            continue;
-        if((obj->walls & (1 << new_direction)) && !this->walk_through_walls) {
-            if(!bumped) {
-                bumped = true;
-                bumped_x = original_x;
-                bumped_y = original_y;
-            }
-            // Go back
-            you->x = original_x;
-            you->y = original_y;
-        }
-    }
-
     ////////////////////////////
     // Check new tile for walls
     ////////////////////////////
     if (!bumped) {
         int dense_wall_bit = 1 << ((new_direction + 4) & 7); // For the new cell, the direction to check is rotated 180 degrees
-        cell = &this->town_map.cells[new_y * this->town_map.width + new_x];
-
-        turf = cell->turf.get(this);
-        if(turf && turf->type == MAP_TILE_SIGN && !already_showed_sign) {
-            //printf("\x1b[35m%s says: %s\x1b[0m\n", (turf->name=="sign" || turf->name.empty()) ? "The sign" : turf->name.c_str(), turf->message.c_str());
-            std::string i_text, i_name;
-            html_encode(i_name, turf->name.c_str());
-            html_encode(i_text, turf->message.c_str());
-            this->log_message(std::format("<span style=\"color:pink;\">{} says: {}</span>", (i_name=="sign" || i_name.empty()) ? "The sign" : i_name, i_text), "server_message");
-        }
-        if(turf && (turf->walls & dense_wall_bit) && !this->walk_through_walls) {
-            if (turf && turf->type == MAP_TILE_SIGN)
-                already_showed_sign = true;
-            // Go back
-            bumped = true;
-            bumped_x = you->x;
-            bumped_y = you->y;
-            you->x = original_x;
-            you->y = original_y;
-        }
+        index = new_y * map->width + new_x;
 
-        for(auto & obj_reference : cell->objs) {
-            MapTileInfo *obj = obj_reference.get(this);
-            if(!obj)
-                continue;
-            if(obj->type == MAP_TILE_SIGN && !already_showed_sign) {
-                //printf("\x1b[35m%s says: %s\x1b[0m\n", (obj->name=="sign" || obj->name.empty()) ? "The sign" : obj->name.c_str(), obj->message.c_str());
+        if(!(map->cell_flags[index] & MAP_CELL_HAS_SIGN)) {
+            if((map->cell_walls[index] & dense_wall_bit) && !this->walk_through_walls) {
+                // Go back
+                bumped = true;
+                bumped_x = you->x;
+                bumped_y = you->y;
+                you->x = original_x;
+                you->y = original_y;
+            }
+        } else {
+            // Signs are uncommon, so only cells with one look at each tile, to show the message
+            MapTileInfo *turf = this->tiles.get(map->turf[index]);
+            if(turf && turf->type == MAP_TILE_SIGN && !already_showed_sign) {
+                //printf("\x1b[35m%s says: %s\x1b[0m\n", (turf->name=="sign" || turf->name.empty()) ? "The sign" : turf->name.c_str(), turf->message.c_str());
                 std::string i_text, i_name;
-                html_encode(i_name, obj->name.c_str());
-                html_encode(i_text, obj->message.c_str());
+                html_encode(i_name, turf->name.c_str());
+                html_encode(i_text, turf->message.c_str());
                 this->log_message(std::format("<span style=\"color:pink;\">{} says: {}</span>", (i_name=="sign" || i_name.empty()) ? "The sign" : i_name, i_text), "server_message");
-                this->already_showed_sign = true;
             }
-            if((obj->walls & dense_wall_bit) && !this->walk_through_walls) {
-                if(!bumped) {
-                    bumped = true;
-                    bumped_x = you->x;
-                    bumped_y = you->y;
-                }
-                if(obj->type == MAP_TILE_SIGN)
-                    this->already_showed_sign = true;
+            if(turf && (turf->walls & dense_wall_bit) && !this->walk_through_walls) {
+                if (turf && turf->type == MAP_TILE_SIGN)
+                    already_showed_sign = true;
                 // Go back
+                bumped = true;
+                bumped_x = you->x;
+                bumped_y = you->y;
                 you->x = original_x;
                 you->y = original_y;
             }
+
+            for(int i=0; i<map->obj_count[index]; i++) {
+                MapTileInfo *obj = this->tiles.get(map->obj_pool[map->obj_start[index] + i]);
+                if(!obj)
+                    continue;
+                if(obj->type == MAP_TILE_SIGN && !already_showed_sign) {
+                    //printf("\x1b[35m%s says: %s\x1b[0m\n", (obj->name=="sign" || obj->name.empty()) ? "The sign" : obj->name.c_str(), obj->message.c_str());
+                    std::string i_text, i_name;
+                    html_encode(i_name, obj->name.c_str());
+                    html_encode(i_text, obj->message.c_str());
+                    this->log_message(std::format("<span style=\"color:pink;\">{} says: {}</span>", (i_name=="sign" || i_name.empty()) ? "The sign" : i_name, i_text), "server_message");
+                    this->already_showed_sign = true;
+                }
+                if((obj->walls & dense_wall_bit) && !this->walk_through_walls) {
+                    if(!bumped) {
+                        bumped = true;
+                        bumped_x = you->x;
+                        bumped_y = you->y;
+                    }
+                    if(obj->type == MAP_TILE_SIGN)
+                        this->already_showed_sign = true;
+                    // Go back
+                    you->x = original_x;
+                    you->y = original_y;
+                }
+            }
         }
     }
 
+    this->entity_moved(you);
+    you->start_walk(original_x, original_y);
+
     //////////////////////////////////////
     // Tell the server about the movement
     //////////////////////////////////////
@@ -686,6 +1183,7 @@ void TilemapTownClient::move_player(int offset_x, int offset_y) {
     cJSON_Delete(json);
 
     you->walk_timer = 30+1; // 30*(16.6666ms/1000) = 0.5
+    this->entity_started_moving(you);
 }
 
 void TilemapTownClient::offset_player(int offset_change_x, int offset_change_y) {
@@ -709,6 +1207,7 @@ void TilemapTownClient::offset_player(int offset_change_x, int offset_change_y)
         return;
     you->offset_x = new_offset_x;
     you->offset_y = new_offset_y;
+    this->entity_moved(you);
 
     cJSON *json = cJSON_CreateObject();
     int offset_array[2] = {new_offset_x, new_offset_y};
@@ -719,6 +1218,34 @@ void TilemapTownClient::offset_player(int offset_change_x, int offset_change_y)
     cJSON_Delete(json);
 }
 
+void EntityMove::merge(const EntityMove &later) {
+    if(later.has_to) {
+        this->has_to = true;
+        this->to_x = later.to_x;
+        this->to_y = later.to_y;
+    }
+    if(later.has_offset) {
+        this->has_offset = true;
+        this->offset_x = later.offset_x;
+        this->offset_y = later.offset_y;
+    }
+    if(later.has_dir) {
+        // The newest direction wins, but older ones may be the last to have set direction_4 or direction_lr
+        if(this->has_dir) {
+            if((this->dir & 1) == 0) {
+                this->has_dir_4 = true;
+                this->dir_4 = this->dir;
+            }
+            if(this->dir == 0 || this->dir == 4) {
+                this->has_dir_lr = true;
+                this->dir_lr = this->dir;
+            }
+        }
+        this->has_dir = true;
+        this->dir = later.dir;
+    }
+}
+
 void Entity::update_direction(int direction) {
     this->direction = direction;
 
@@ -728,8 +1255,115 @@ void Entity::update_direction(int direction) {
         this->direction_lr = direction;
 }
 
+// How many pixels a sliding entity moves each simulation step
+#define WALK_SLIDE_SPEED 2
+
+void Entity::start_walk(int old_x, int old_y) {
+    int distance_x = old_x - this->x;
+    int distance_y = old_y - this->y;
+    if(distance_x < -1 || distance_x > 1 || distance_y < -1 || distance_y > 1) {
+        // Jumped too far to slide there
+        this->slide_x = 0;
+        this->slide_y = 0;
+        return;
+    }
+    // Keep going from wherever an earlier slide got to
+    this->slide_x = std::clamp(this->slide_x + distance_x * 16, -32, 32);
+    this->slide_y = std::clamp(this->slide_y + distance_y * 16, -32, 32);
+}
+
+static int slide_toward_zero(int slide) {
+    if(slide > 0)
+        return std::max(slide - WALK_SLIDE_SPEED, 0);
+    return std::min(slide + WALK_SLIDE_SPEED, 0);
+}
+
+void TilemapTownClient::entity_started_moving(Entity *entity) {
+    EntityHandle handle = this->who.handle_for(entity->id);
+    if(!handle || entity->in_moving_list)
+        return;
+    entity->in_moving_list = true;
+    this->moving_entities.push_back(handle);
+}
+
+bool TilemapTownClient::simulation_step() {
+    for(size_t i=0; i<this->moving_entities.size(); ) {
+        // Entities that were removed since they started moving won't be found anymore
+        Entity *entity = this->who.get(this->moving_entities[i]);
+        if(entity && entity->slide_x == 0 && entity->slide_y == 0 && entity->walk_timer > 1) {
+            entity->walk_timer--;
+            i++;
+            continue;
+        }
+        if(entity) {
+            // Redraw where it was and where it is now
+            this->mark_dirty(entity->map_rect());
+            entity->slide_x = slide_toward_zero(entity->slide_x);
+            entity->slide_y = slide_toward_zero(entity->slide_y);
+            if(entity->walk_timer)
+                entity->walk_timer--;
+            this->mark_dirty(entity->map_rect());
+        }
+        if(!entity || (entity->slide_x == 0 && entity->slide_y == 0 && entity->walk_timer == 0)) {
+            if(entity)
+                entity->in_moving_list = false;
+            this->moving_entities[i] = this->moving_entities.back();
+            this->moving_entities.pop_back();
+        } else {
+            i++;
+        }
+    }
+    return !this->moving_entities.empty();
+}
+
 #ifndef USING_QT
 void TilemapTownClient::log_message(std::string text, std::string style) {
     puts(text);
 }
 #endif
+
+#ifdef USING_QT
+// The websocket itself is in network.cpp, so that programs that only feed recorded messages to the client don't need QtWebSockets
+TilemapTownClient::~TilemapTownClient() {
+    this->network_thread.requestInterruption();
+    this->network_thread.quit();
+    this->network_thread.wait();
+}
+
+void TilemapTownClient::websocket_write(std::string text) {
+    if(this->send_text)
+        this->send_text(text);
+}
+
+// Decoded messages are applied for at most this long before letting the event loop handle input and painting
+#define APPLY_TIME_BUDGET_NS 8000000
+
+void TilemapTownClient::apply_decoded_messages() {
+    // Cleared first, so that a message pushed from now on schedules another call
+    this->apply_scheduled.store(false);
+
+    QElapsedTimer timer;
+    timer.start();
+    std::unique_ptr<DecodedMessage> message;
+    while(this->decoded_messages.pop(message)) {
+        this->apply_decoded(*message);
+        message.reset();
+        if(timer.nsecsElapsed() > APPLY_TIME_BUDGET_NS && !this->decoded_messages.empty()) {
+            if(!this->apply_scheduled.exchange(true))
+                QMetaObject::invokeMethod(this, [this]() { this->apply_decoded_messages(); }, Qt::QueuedConnection);
+            return;
+        }
+    }
+}
+
+void TilemapTownClient::onWebSocketConnected() {
+    log_message("Connected to server", "");
+    this->connected = true;
+    this->connected_to_server();
+}
+
+void TilemapTownClient::onWebSocketDisconnected() {
+    this->connected = false;
+    log_message("Disconnected from server", "");
+}
+#endif
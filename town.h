@@ -19,14 +19,15 @@
 #ifndef TOWN_H
 #define TOWN_H
 
-#include "townfilecache.h"
+#include "jsonarena.h"
+#include "sessionlog.h"
 
 #include <memory>
+#include <deque>
 #include <vector>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
-#include <variant>
 
 #include <stdint.h>
 #include <stdio.h>
@@ -53,48 +54,103 @@
 #include <3ds.h>
 #include <citro2d.h>
 #elif defined(USING_QT)
-#include <qpixmap.h>
-#include <QtWebSockets/QWebSocket>
+#include <QObject>
+#include <QThread>
+#include <atomic>
+#include <functional>
+#include "spscqueue.h"
+#endif
+
+// The Qt build keeps images and the websocket out of this header, so the core only needs QtCore
+#ifdef USING_QT
+class NetworkWorker;
+class TownFileCache;
+struct PixmapRegion;
+#else
+#include "townfilecache.h"
 #endif
 
 class TilemapTownClient;
 
 // ------------------------------------
+struct cJSON;
+class JSONReader;
 struct MapTileInfo;
+class EntityList;
+
+// Handle to a tile in the client's TileRegistry; 0 means there's no tile
+typedef uint32_t MapTileID;
+
+// Entity ID from the server, interned by EntityList; 0 means there's no entity
+typedef uint32_t EntityID;
+// Slot in an EntityList; 0 means there's no entity
+typedef uint64_t EntityHandle;
+
+// Which neighbors of a cell match for autotiling purposes
+enum AutotileNeighbor {
+    AUTOTILE_W  = 1,
+    AUTOTILE_E  = 2,
+    AUTOTILE_N  = 4,
+    AUTOTILE_S  = 8,
+    AUTOTILE_NW = 16,
+    AUTOTILE_NE = 32,
+    AUTOTILE_SW = 64,
+    AUTOTILE_SE = 128,
+};
 
-struct MapTileReference {
-    std::variant<std::monostate, std::string, std::shared_ptr<MapTileInfo>> tile;
-
-    MapTileInfo* get(TilemapTownClient *client);
+// Which downloads go first; lower values are more urgent
+enum AssetPriority {
+    ASSET_PRIORITY_VISIBLE_TILE,
+    ASSET_PRIORITY_VISIBLE_ENTITY,
+    ASSET_PRIORITY_PREFETCH,      // Used somewhere on the map, or revalidating a copy that's already shown
+};
 
-    MapTileReference();
-    MapTileReference(struct cJSON *json, TilemapTownClient *client);
-    MapTileReference(std::string str);
-    MapTileReference(std::string str, TilemapTownClient *client);
-    MapTileReference(MapTileInfo *tile, TilemapTownClient *client);
-    MapTileReference(std::shared_ptr<MapTileInfo> tile);
+// Extra information about a cell, in TownMap::cell_flags
+enum MapCellFlag {
+    MAP_CELL_HAS_SIGN = 1, // The turf or one of the objs is a sign
 };
 
-struct MapCell {
-    struct MapTileReference turf;
-    std::vector<struct MapTileReference> objs;
+// simulation_step() should be called this many times a second
+#define SIMULATION_STEPS_PER_SECOND 60
 
-    MapCell();
-    MapCell(struct MapTileReference turf);
-};
+// Maps are split into square chunks of cells so that renderers can cache what they drew
+#define MAP_CHUNK_SIZE 16
 
 class TownMap {
 public:
-    int width, height;
-    std::vector<MapCell> cells;
+    int width = 0, height = 0;
+
+    // Turf, one per cell
+    std::vector<MapTileID> turf;
+    std::vector<uint8_t> turf_autotile;     // AutotileNeighbor bits for each cell's turf
+
+    // Objs, stored in one shared pool that each cell has a span of
+    std::vector<uint32_t> obj_start;
+    std::vector<uint16_t> obj_count;
+    std::vector<MapTileID> obj_pool;
+    std::vector<uint8_t> obj_pool_autotile; // AutotileNeighbor bits for each obj in obj_pool
+    size_t obj_pool_unused = 0;             // How many entries in obj_pool aren't part of any cell's span
+
+    // Collision, so moving doesn't have to look at every tile in a cell; see TilemapTownClient::update_collision()
+    std::vector<uint8_t> cell_walls;        // The walls of the turf and every obj combined; bit n blocks direction n
+    std::vector<uint8_t> cell_flags;        // MapCellFlag bits
 
     // Metadata
     int id;
     std::string name;
 
+    // Change tracking
+    uint32_t generation = 0;              // Incremented whenever the map is reinitialized
+    int chunks_wide = 0, chunks_tall = 0;
+    std::vector<uint32_t> chunk_revision; // Incremented whenever a cell inside the chunk changes
+    std::vector<std::vector<uint8_t>> chunk_animated_cells; // For each chunk, cells (y*MAP_CHUNK_SIZE+x inside the chunk) with an animated turf or obj
+
     void init_map(int width, int height);
-};
+    void touch_cells(int x1, int y1, int x2, int y2);
 
+    void set_objs(int index, const MapTileID *objs, int count);
+    void compact_objs();
+};
 
 struct Pic {
     std::string key; // URL or integer
@@ -105,12 +161,18 @@ struct Pic {
 #ifdef __3DS__
     MultiTextureInfo *get_textures(TilemapTownClient *client) const;
 #elif defined(USING_QT)
-    const QPixmap *get_pixmap(TilemapTownClient *client) const;
+    const PixmapRegion *get_pixmap(TilemapTownClient *client, AssetPriority priority = ASSET_PRIORITY_VISIBLE_TILE) const;
 #endif
 
     std::size_t hash() const;
 };
 
+// Inclusive rectangle of map cells
+struct MapRect {
+    int x1, y1, x2, y2;
+};
+void add_map_rect(std::vector<MapRect> &rects, MapRect rect); // Merges it with any rectangles it overlaps or touches
+
 class Entity {
 public:
     std::string name;
@@ -119,23 +181,165 @@ public:
     int y;
     bool in_user_list;
 
-    std::string vehicle_id;
-    std::unordered_set <std::string> passengers;
+    EntityID id = 0;
+    EntityID vehicle = 0;
+    std::vector<EntityID> passengers;
     bool is_following;
 
     bool is_typing;
 
+    int row = -1; // Which of TilemapTownClient::entity_rows this entity is in
+
     // Animation
-    int walk_timer;
+    int walk_timer;         // Simulation steps left to show the walking animation for
+    int slide_x, slide_y;   // Pixels away from x,y to draw the entity at, while it slides into the cell it moved to
+    bool in_moving_list;    // In TilemapTownClient::moving_entities
     int direction;
     int direction_4;
     int direction_lr;
     int offset_x;
     int offset_y;
 
-    std::string apply_json(cJSON *json);
+    EntityID apply_json(cJSON *json, EntityList &list); // Returns the "id" from the JSON, if there was one
     void update_direction(int direction);
+    void start_walk(int old_x, int old_y); // Call after changing x,y
+    MapRect map_rect() const; // Cells the entity's picture can cover
+};
+
+// Every entity the client knows about, stored in slots that get reused
+class EntityList {
+public:
+    EntityList();
+    EntityID intern_id(const std::string &id);
+    EntityID find_id(const std::string &id) const; // 0 if the ID has never been seen
+    const std::string &id_string(EntityID id) const;
+    size_t id_count() const { return this->id_for_string.size(); }
+    void release_unused_ids(EntityID keep); // Frees every ID besides 'keep' that no entity has or rides with, so it can be reused
+
+    Entity *add(EntityID id, const Entity &entity); // Replaces the entity with this ID, if there is one
+    void remove(EntityID id);
+    bool rename(EntityID id, EntityID new_id);
+    void clear();
+    size_t size() const { return this->count; }
+
+    inline EntityHandle handle_for(EntityID id) const {
+        return id < this->handle_for_id.size() ? this->handle_for_id[id] : 0;
+    }
+    inline Entity *get(EntityHandle handle) {
+        Slot &slot = this->entries[handle & ENTITY_HANDLE_INDEX_MASK];
+        if(!slot.used || slot.handle != handle)
+            return nullptr;
+        return &slot.entity;
+    }
+    inline Entity *find(EntityID id) {
+        return this->get(this->handle_for(id));
+    }
+
+    template <typename F> void for_each(F f) {
+        for(Slot &slot : this->entries) {
+            if(slot.used)
+                f(slot.entity);
+        }
+    }
+
+private:
+    // Like MapTileID, the upper bits of a handle count how many times the slot was reused.
+    // There are 32 of them, so an old handle won't come back around to a new entity.
+    static const uint64_t ENTITY_HANDLE_INDEX_MASK = 0xffffffff;
+
+    struct Slot {
+        Entity entity;
+        EntityHandle handle;
+        bool used;
+    };
+    std::deque<Slot> entries; // Deque so that pointers to entities stay valid when adding more
+    std::vector<uint32_t> free_slots;
+    size_t count;
+
+    std::unordered_map<std::string, EntityID> id_for_string;
+    std::vector<std::string> id_strings;     // Indexed by EntityID
+    std::vector<EntityHandle> handle_for_id; // Indexed by EntityID
+    std::vector<EntityID> free_ids;          // Released by release_unused_ids()
+};
+
+// Contents of a MOV message, or several MOVs for the same entity merged together
+struct EntityMove {
+    EntityID id;
+    bool has_from;
+    bool has_to;
+    bool has_offset;
+    bool has_dir;
+    int to_x, to_y;
+    int offset_x, offset_y;
+    int dir;
+
+    // Earlier directions that still affect direction_4 and direction_lr after merging
+    bool has_dir_4, has_dir_lr;
+    int dir_4, dir_lr;
+
+    void merge(const EntityMove &later);
+};
+
+// One rectangle filled by a BLK message
+struct MapFill {
+    bool obj; // Fills objs instead of turf
+    int x, y, width, height;
+    MapTileID turf;
+    uint32_t obj_start; // Index into TilemapTownClient::batch_fill_objs
+    uint16_t obj_count;
+};
+
+// Turf and objs from a MAP or BLK, read out of the JSON without touching the client.
+// Tiles are numbers into 'tiles', which holds each different tile's JSON once; 0 means no tile.
+struct DecodedCells {
+    struct Turf {
+        int x, y, width, height;
+        uint32_t tile;
+    };
+    struct Objs {
+        int x, y, width, height;
+        uint32_t first, count; // Range in obj_tiles
+    };
+    std::vector<std::string> tiles;
+    std::vector<Turf> turf;
+    std::vector<Objs> objs;
+    std::vector<uint32_t> obj_tiles;
+    int pos[4];                  // MAP only
+    bool has_pos = false;
+    uint32_t default_tile = 0;
+};
+
+// An entity from WHO. The IDs stay strings until it's applied, since only the thread that owns the EntityList can intern them.
+struct DecodedEntity {
+    Entity entity = Entity();
+    std::string id, vehicle;
+    std::vector<std::string> passengers;
+    bool has_id = false, has_vehicle = false, has_passengers = false;
+
+    EntityID intern_ids(EntityList &list); // Fills in entity.vehicle and entity.passengers, and returns the ID
+};
+
+// A message from the server after decode_message() has read what it could out of it, which can happen on another thread.
+// TilemapTownClient::apply_decoded() then only has to apply it.
+struct DecodedMessage {
+    int command = 0;
+    bool decoded = false;              // If false, 'text' goes through websocket_message() like before
+    std::string text;
+    std::vector<DecodedMessage> batch; // Each line of a BAT
+
+    // MOV
+    std::string entity_id;
+    EntityMove move;
+
+    std::unique_ptr<DecodedCells> cells; // MAP and BLK
+
+    // WHO, except for "update"
+    std::string you, remove;
+    bool has_you = false, you_is_valid = false, has_remove = false, has_list = false;
+    std::vector<DecodedEntity> list;
+    std::unique_ptr<DecodedEntity> add;
 };
+bool decode_message(const char *text, size_t length, DecodedMessage &out);
 
 enum MapTileType {
     MAP_TILE_NONE,
@@ -165,6 +369,44 @@ struct MapTileInfo {
     std::size_t hash() const;
 };
 
+// Owns every tile the client knows about, and hands out MapTileIDs for them.
+// IDs for custom JSON tiles are reclaimed once no map from the last couple of epochs (map changes) has used them.
+class TileRegistry {
+public:
+    TileRegistry();
+    MapTileID intern_key(const std::string &key); // The tile may not be defined yet
+    MapTileID intern_info(const MapTileInfo &info);
+    MapTileID define(const std::string &key, const MapTileInfo &info);
+    void begin_epoch();
+
+    inline MapTileInfo *get(MapTileID id) {
+        Slot &slot = this->entries[id & MAP_TILE_ID_INDEX_MASK];
+        if(!slot.defined || slot.id != id)
+            return nullptr;
+        return &slot.info;
+    }
+
+private:
+    // The upper bits of a MapTileID count how many times the slot was reused, so stale IDs don't find the wrong tile
+    static const uint32_t MAP_TILE_ID_INDEX_MASK = 0x00ffffff;
+
+    struct Slot {
+        MapTileInfo info;
+        MapTileID id;
+        bool defined;        // False for keys that haven't been sent in RSC yet
+        bool from_json;      // Custom tile; can be reclaimed
+        std::size_t hash;    // For custom tiles
+        uint32_t last_epoch; // Last epoch the tile was interned in
+    };
+    std::deque<Slot> entries; // Deque so that pointers to tiles stay valid when adding more
+    std::vector<uint32_t> free_slots;
+    std::unordered_map<std::string, MapTileID> id_for_key;
+    std::unordered_map<std::size_t, MapTileID> id_for_hash;
+    uint32_t epoch;
+
+    MapTileID new_slot();
+};
+
 // ------------------------------------
 
 class TilemapTownClient
@@ -186,7 +428,15 @@ class TilemapTownClient
     mbedtls_x509_crt cacert;
 #else
     Q_OBJECT
-    QWebSocket websocket;
+    friend class NetworkWorker;
+
+    // Messages are received and decoded on network_thread, then applied on this object's thread
+    QThread network_thread;
+    NetworkWorker *network_worker = nullptr; // Created by the first websocket_connect()
+    SPSCQueue<std::unique_ptr<DecodedMessage>> decoded_messages{4096};
+    std::atomic<bool> apply_scheduled{false};
+    std::function<void(const std::string &text)> send_text; // Set by websocket_connect(); until then, websocket_write() drops messages
+    void apply_decoded_messages(); // Applies what's in decoded_messages, until it takes too long
 #endif
 
 public:
@@ -195,22 +445,40 @@ public:
 
     // Game state
     TownMap town_map;
-    std::unordered_map<std::string, Entity> who;
-    std::unordered_map<std::size_t, std::weak_ptr<MapTileInfo>> json_tileset; // Custom JSON tiles, referenced by hash
+    EntityList who;
+    std::vector<std::vector<Entity*>> entity_rows; // Entities in 'who' bucketed by map row, so drawing only visits rows on screen
+    int entity_offset_limit = 0; // Largest offset in pixels, either way, of any entity since they were last cleared; drawing looks that much further out
+    TileRegistry tiles; // From RSC, TSD and custom tiles in MAP and BLK
 
     std::unordered_map<std::string, std::string> url_for_tile_sheet; // From RSC and IMG
     std::unordered_set<std::string> requested_tile_sheets; // IMG already sent
 
-    std::unordered_map<std::string, std::shared_ptr<MapTileInfo>> tileset; // From RSC and TSD
     std::unordered_set<std::string> requested_tilesets; // TSD already sent
 
     bool map_received;
     bool need_redraw;
+    uint32_t asset_revision = 0; // Incremented when tile definitions or image URLs arrive
     bool in_batch = false; // Currently processing a batch message
-    int animation_tick;
+    std::unordered_map<EntityID, EntityMove> batch_moves; // MOVs and BLKs in a batch are held here and applied together
+    std::vector<MapFill> batch_fills;
+    std::vector<MapTileID> batch_fill_objs;
+    std::vector<MapRect> batch_changed_cells;
+    std::vector<MapRect> dirty_cells; // Cells that look different since the map view last took these
+    bool dirty_everything = false;    // Something changed that affects the whole view
+    bool streaming_parser = true; // Read MAP, BLK, MOV and WHO straight out of the message text instead of building a cJSON tree
+    int animation_tick = 0; // Tenths of a second, for animated tiles
+    std::vector<EntityHandle> moving_entities; // Entities that simulation_step() still needs to update
+
+    SessionLogWriter session_recorder; // Writes every message from the server to a file while open
+
+    // Reused while parsing messages
+    JSONArena json_arena;
+    std::string tile_key_buffer;
+    std::string entity_id_buffer;
+    std::vector<MapTileID> obj_buffer;
 
     // Player state
-    std::string your_id;
+    EntityID your_id = 0;
     float camera_x;
     float camera_y;
     bool walk_through_walls;
@@ -224,10 +492,20 @@ public:
     void websocket_write(std::string text);
     void websocket_write(std::string command, cJSON *json);
     void websocket_message(const char *text, size_t length);
+    bool websocket_message_streaming(int command, const char *text, size_t length);
+    void apply_decoded(DecodedMessage &message); // Same result as websocket_message() on the text decode_message() got
 
     void update_camera(float offset_x, float offset_y);
     void draw_map(int camera_x, int camera_y);
     Entity *your_entity();
+    Entity *set_entity(EntityID id, const Entity &entity); // Adds or replaces an entity in 'who'
+    void remove_entity(EntityID id);
+    void rename_entity(EntityID id, EntityID new_id);
+    void clear_entities();
+    void release_entity_ids(); // Call after WHO; frees the IDs of entities that left, once there are enough of them
+    void entity_moved(Entity *entity); // Updates entity_rows and entity_offset_limit after changing an entity's y or offset
+    void rebuild_entity_rows();
+    void collect_image_urls(std::unordered_set<std::string> &urls); // Images used by the map and by entities in 'who'
 
     // Utilties to send protocol messages
     void login(const char *username, const char *password);
@@ -238,14 +516,34 @@ public:
     void request_tileset_asset(std::string key);
 
     // Autotile utilities
-    bool is_turf_autotile_match(const MapTileInfo *turf, TownMap *map, int map_x, int map_y);
-    bool is_obj_autotile_match(const MapTileInfo *obj, TownMap *map, int map_x, int map_y);
-    unsigned int get_turf_autotile_index_4(const MapTileInfo *turf, TownMap *map, int map_x, int map_y);
-    unsigned int get_obj_autotile_index_4(const MapTileInfo *obj, TownMap *map, int map_x, int map_y);
-    bool calc_pic_quarters(int quarter_x[4], int quarter_y[4], const MapTileInfo *tile, bool obj, TownMap *map, int map_x, int map_y, int tenth_of_second_counter);
+    bool is_turf_autotile_match(const MapTileInfo *turf, MapTileID turf_id, TownMap *map, int map_x, int map_y);
+    bool is_obj_autotile_match(const MapTileInfo *obj, MapTileID obj_id, TownMap *map, int map_x, int map_y);
+    uint8_t get_autotile_neighbors(const MapTileInfo *tile, MapTileID tile_id, bool obj, TownMap *map, int map_x, int map_y);
+    bool calc_pic_quarters(int quarter_x[4], int quarter_y[4], const MapTileInfo *tile, uint8_t neighbors, int tenth_of_second_counter);
+    void update_autotile_neighbors(int x1, int y1, int x2, int y2);
+    bool simulation_step(); // Advances walking entities; returns true if anything is still moving
+    void entity_started_moving(Entity *entity);
 
     // Miscellaneous utilities
-    std::shared_ptr<MapTileInfo> get_shared_pointer_to_tile(MapTileInfo *tile); // Get cached copy from json_tileset, or cache the tile for later use
+    MapTileID tile_from_json(cJSON *json); // Accepts a tile key or a custom tile
+    MapTileID tile_from_json(JSONReader &reader);
+    EntityID entity_id_from_json(cJSON *json); // Only finds IDs that have been seen before, and doesn't allocate
+    void apply_move(const EntityMove &move);
+    void fill_turf(int x, int y, int width, int height, MapTileID tile);
+    void fill_objs(int x, int y, int width, int height, const MapTileID *objs, int count);
+    void flush_batch(); // Applies the MOVs and BLKs collected so far in the current batch
+    void map_cells_changed(int x1, int y1, int x2, int y2); // Called after MAP or BLK changes a rectangle of cells
+    void tiles_changed(const std::unordered_set<MapTileID> &ids); // Called after RSC redefines tiles, for the cells that use them
+    void mark_dirty(MapRect rect); // Adds to dirty_cells
+    void update_animated_cells(int x1, int y1, int x2, int y2); // Rebuilds TownMap::chunk_animated_cells for the chunks touching the rectangle
+    void update_collision(int x1, int y1, int x2, int y2); // Recalculates TownMap::cell_walls and cell_flags inside the rectangle
+
+private:
+    void move_entity(const EntityMove &move);
+    void write_fill(const MapFill &fill, const MapTileID *objs);
+    void refresh_cells(int x1, int y1, int x2, int y2);
+
+public:
 
     // Displaying messages involves the protocol code initiating a UI change - for Qt, this is done with a signal,
     // but on other platforms it may involve writing to global state somewhere.
@@ -263,9 +561,9 @@ signals:
 private Q_SLOTS:
     void onWebSocketConnected();
     void onWebSocketDisconnected();
-    void onWebSocketError(QAbstractSocket::SocketError error);
-    void onWebSocketTextMessageReceived(QString message);
-    void onWebSocketSslErrors(const QList<QSslError> &errors);
+
+public:
+    ~TilemapTownClient();
 #endif
 };
 
@@ -1,29 +1,522 @@
 #include "townfilecache.h"
+#include "town.h"
+#include <algorithm>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QPainter>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QTimer>
+
+// Files in the disk cache that were confirmed this recently are used without asking the server
+#define DISK_CACHE_FRESH_SECONDS (60*60*24)
+
+// Downloads from the same server that can be in progress at once
+#define MAX_REQUESTS_PER_HOST 4
+
+// How long to wait before trying a failed download again, doubling after each failure
+#define RETRY_DELAY_MIN_MS 2000
+#define RETRY_DELAY_MAX_MS (10*60*1000)
+
+// Images that fit in a cell this size or smaller go in atlas pages
+#define ATLAS_PAGE_SIZE     1024
+#define ATLAS_MIN_CELL_SIZE 16
+#define ATLAS_MAX_CELL_SIZE 64
+#define ATLAS_PAGE_BYTES    ((size_t)ATLAS_PAGE_SIZE * ATLAS_PAGE_SIZE * 4)
+
+// Memory budgets for decoded images and for the raw files they're decoded from; images in use are kept even when over budget
+#define DECODED_BUDGET_BYTES (256*1024*1024)
+#define RAW_BUDGET_BYTES     (32*1024*1024)
 
 TownFileCache::TownFileCache() {
     connect(&this->network_access_manager, &QNetworkAccessManager::finished, this, &TownFileCache::onFileDownloaded);
+    this->retry_timer.setSingleShot(true);
+    connect(&this->retry_timer, &QTimer::timeout, this, &TownFileCache::retry_downloads);
+
+    this->disk_cache_directory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/assets";
+    if(!QDir().mkpath(this->disk_cache_directory))
+        this->disk_cache_directory.clear();
 }
 
-void TownFileCache::onFileDownloaded(QNetworkReply* reply) {
-    QPixmap image;
-    image.loadFromData(reply->readAll());
-    this->image_for_url[reply->url().toString().toStdString()] = image;
+/////////////////////////////////////////////////
+
+QString TownFileCache::disk_cache_path(const std::string &url) const {
+    QByteArray hash = QCryptographicHash::hash(QByteArray(url.data(), url.size()), QCryptographicHash::Sha1);
+    return QDir(this->disk_cache_directory).filePath(QString::fromLatin1(hash.toHex()));
+}
+
+bool TownFileCache::load_from_disk_cache(const std::string &url, QByteArray &data, disk_cache_meta &meta) const {
+    if(this->disk_cache_directory.isEmpty())
+        return false;
+    QString path = this->disk_cache_path(url);
+
+    QFile meta_file(path + ".meta");
+    if(!meta_file.open(QIODevice::ReadOnly))
+        return false;
+    QList<QByteArray> lines = meta_file.readAll().split('\n');
+    if(lines.size() < 3)
+        return false;
+    meta.etag          = lines[0];
+    meta.last_modified = lines[1];
+    meta.fetched_at    = lines[2].toLongLong();
+
+    QFile data_file(path);
+    if(!data_file.open(QIODevice::ReadOnly))
+        return false;
+    data = data_file.readAll();
+    return !data.isEmpty();
+}
+
+// Writes the file's data (if provided) and then its metadata; passing nullptr for data just updates the metadata
+void TownFileCache::save_to_disk_cache(const std::string &url, const QByteArray *data, const disk_cache_meta &meta) const {
+    if(this->disk_cache_directory.isEmpty())
+        return;
+    QString path = this->disk_cache_path(url);
+
+    if(data) {
+        QSaveFile data_file(path);
+        if(!data_file.open(QIODevice::WriteOnly))
+            return;
+        data_file.write(*data);
+        if(!data_file.commit())
+            return;
+    }
+
+    QSaveFile meta_file(path + ".meta");
+    if(!meta_file.open(QIODevice::WriteOnly))
+        return;
+    meta_file.write(meta.etag + '\n' + meta.last_modified + '\n' + QByteArray::number(meta.fetched_at) + '\n');
+    meta_file.commit();
+}
+
+/////////////////////////////////////////////////
+
+// Images in an atlas are paid for by their page instead
+static size_t region_bytes(const PixmapRegion &region, int atlas_page) {
+    return region.pixmap && atlas_page < 0 ? (size_t)region.rect.width() * region.rect.height() * 4 : 0;
+}
+
+TownFileCache::cached_file &TownFileCache::store_file(const std::string &url, const QByteArray &data, const QImage &image) {
+    cached_file &file = this->image_for_url[url];
+    this->drop_image(file);
+    this->raw_bytes -= file.data.size();
+    if(!this->add_to_atlas(file, image)) {
+        file.pixmap = QPixmap::fromImage(image);
+        file.region.pixmap = &file.pixmap;
+        file.region.rect   = QRect(0, 0, image.width(), image.height());
+    }
+    file.data     = data;
+    file.evicted  = false;
+    file.decoding = false;
+    this->decoded_bytes += region_bytes(file.region, file.atlas_page);
+    this->raw_bytes     += file.data.size();
+    this->touch(url, file);
+    this->schedule_trim();
+    return file;
+}
+
+void TownFileCache::drop_image(cached_file &file) {
+    this->decoded_bytes -= region_bytes(file.region, file.atlas_page);
+    this->remove_from_atlas(file);
+    file.pixmap = QPixmap();
+    file.region = PixmapRegion();
+}
+
+bool TownFileCache::add_to_atlas(cached_file &file, const QImage &image) {
+    int size = std::max(image.width(), image.height());
+    if(size <= 0 || size > ATLAS_MAX_CELL_SIZE)
+        return false;
+    int cell_size = ATLAS_MIN_CELL_SIZE;
+    while(cell_size < size)
+        cell_size *= 2;
+
+    int page_index = -1, released_index = -1;
+    for(int i = 0; i < (int)this->atlas_pages.size(); i++) {
+        if(this->atlas_pages[i].cell_size == cell_size && !this->atlas_pages[i].free_cells.empty()) {
+            page_index = i;
+            break;
+        }
+        if(this->atlas_pages[i].cell_size == 0 && released_index < 0)
+            released_index = i;
+    }
+    if(page_index < 0) {
+        if(released_index < 0) {
+            released_index = this->atlas_pages.size();
+            this->atlas_pages.emplace_back();
+        }
+        page_index = released_index;
+        atlas_page &page = this->atlas_pages[page_index];
+        page.pixmap = QPixmap(ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE);
+        page.pixmap.fill(Qt::transparent);
+        page.cell_size = cell_size;
+        for(int cell = (ATLAS_PAGE_SIZE / cell_size) * (ATLAS_PAGE_SIZE / cell_size) - 1; cell >= 0; cell--)
+            page.free_cells.push_back(cell);
+        this->decoded_bytes += ATLAS_PAGE_BYTES;
+    }
+
+    atlas_page &page = this->atlas_pages[page_index];
+    int cell = page.free_cells.back();
+    page.free_cells.pop_back();
+    int cells_per_row = ATLAS_PAGE_SIZE / cell_size;
+    QRect rect((cell % cells_per_row) * cell_size, (cell / cells_per_row) * cell_size, image.width(), image.height());
+
+    QPainter painter(&page.pixmap);
+    painter.setCompositionMode(QPainter::CompositionMode_Source); // Replace whatever was in the cell before
+    painter.drawImage(rect.x(), rect.y(), image);
+    painter.end();
+
+    file.atlas_page    = page_index;
+    file.atlas_cell    = cell;
+    file.region.pixmap = &page.pixmap;
+    file.region.rect   = rect;
+    return true;
+}
+
+void TownFileCache::remove_from_atlas(cached_file &file) {
+    if(file.atlas_page < 0)
+        return;
+    atlas_page &page = this->atlas_pages[file.atlas_page];
+    page.free_cells.push_back(file.atlas_cell);
+    file.atlas_page = -1;
+
+    // Give the page's memory back once nothing is in it
+    int cells_per_row = ATLAS_PAGE_SIZE / page.cell_size;
+    if((int)page.free_cells.size() == cells_per_row * cells_per_row) {
+        page.pixmap = QPixmap();
+        page.free_cells = std::vector<int>();
+        page.cell_size = 0;
+        this->decoded_bytes -= ATLAS_PAGE_BYTES;
+    }
+}
+
+void TownFileCache::touch(const std::string &url, cached_file &file) {
+    if(file.in_lru) {
+        this->lru.splice(this->lru.begin(), this->lru, file.lru_position);
+    } else {
+        file.lru_position = this->lru.insert(this->lru.begin(), url);
+        file.in_lru = true;
+    }
+}
+
+// Trimming waits until control returns to the event loop, so that pixmaps aren't evicted in the middle of painting
+void TownFileCache::schedule_trim() {
+    if(this->trim_scheduled || (this->decoded_bytes <= DECODED_BUDGET_BYTES && this->raw_bytes <= RAW_BUDGET_BYTES))
+        return;
+    this->trim_scheduled = true;
+    QTimer::singleShot(0, this, &TownFileCache::trim);
+}
+
+void TownFileCache::trim() {
+    this->trim_scheduled = false;
+
+    std::unordered_set<std::string> pinned;
+    if(this->client)
+        this->client->collect_image_urls(pinned);
+
+    auto it = this->lru.end();
+    while(it != this->lru.begin() && (this->decoded_bytes > DECODED_BUDGET_BYTES || this->raw_bytes > RAW_BUDGET_BYTES)) {
+        --it;
+        if(pinned.find(*it) != pinned.end())
+            continue;
+        cached_file &file = this->image_for_url[*it];
+
+        if(this->decoded_bytes > DECODED_BUDGET_BYTES && !file.evicted) {
+            this->drop_image(file);
+            file.evicted = true;
+        }
+        // Without the raw bytes, it'll be read back from the disk cache, or downloaded again
+        if(this->raw_bytes > RAW_BUDGET_BYTES && !file.data.isEmpty()) {
+            this->raw_bytes -= file.data.size();
+            file.data = QByteArray();
+        }
+        if(file.evicted && file.data.isEmpty()) {
+            file.in_lru = false;
+            it = this->lru.erase(it);
+        }
+    }
+}
+
+/////////////////////////////////////////////////
+
+// Runs the slow parts (disk access and decoding) on decode_pool; if data is empty, it's read from the disk cache
+void TownFileCache::start_decode(const std::string &url, const QByteArray &data, decode_source source, AssetPriority priority, const disk_cache_meta &meta) {
+    this->decodes_in_progress++;
+    this->decode_pool.start([this, url, data = data, source, priority, meta = meta]() mutable {
+        if(data.isEmpty())
+            this->load_from_disk_cache(url, data, meta);
+        QImage image;
+        if(!data.isEmpty())
+            image.loadFromData(data);
+        if(source == DECODE_DOWNLOAD && !image.isNull())
+            this->save_to_disk_cache(url, &data, meta);
+
+        QMetaObject::invokeMethod(this, [this, url, data, image, source, priority, meta]() {
+            this->finish_decode(url, data, image, source, priority, meta);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void TownFileCache::finish_decode(const std::string &url, const QByteArray &data, const QImage &image, decode_source source, AssetPriority priority, const disk_cache_meta &meta) {
+    this->decodes_in_progress--;
+    if(image.isNull()) {
+        if(source == DECODE_DOWNLOAD) {
+            this->download_failed(url, priority);
+            return;
+        } else {
+            // Nothing usable on disk, so start over with a new download
+            auto find_image = this->image_for_url.find(url);
+            if(find_image != this->image_for_url.end()) {
+                cached_file &file = (*find_image).second;
+                this->drop_image(file);
+                this->raw_bytes -= file.data.size();
+                if(file.in_lru)
+                    this->lru.erase(file.lru_position);
+                this->image_for_url.erase(find_image);
+            }
+            auto find_request = this->pending_requests.find(url);
+            this->queue_request(url, find_request != this->pending_requests.end() ? (*find_request).second.priority : priority, nullptr);
+            return;
+        }
+    } else {
+        // A fresh download of something already in image_for_url means the server had a newer copy
+        if(source == DECODE_DOWNLOAD && this->image_for_url.find(url) != this->image_for_url.end())
+            this->replaced_revision++;
+        this->store_file(url, data, image);
+        this->failed_downloads.erase(url);
+        auto find_request = this->pending_requests.find(url);
+        if(find_request != this->pending_requests.end() && (*find_request).second.checking_disk)
+            this->pending_requests.erase(find_request);
+        if(source == DECODE_DISK && QDateTime::currentSecsSinceEpoch() - meta.fetched_at >= DISK_CACHE_FRESH_SECONDS)
+            this->queue_request(url, ASSET_PRIORITY_PREFETCH, &meta);
+    }
+    this->revision++;
     emit this->request_redraw();
+}
+
+/////////////////////////////////////////////////
+
+void TownFileCache::queue_request(const std::string &url, AssetPriority priority, const disk_cache_meta *revalidate) {
+    asset_request &request = this->pending_requests[url];
+    if(request.reply)
+        return;
+    request.priority      = priority;
+    request.checking_disk = false;
+    request.revalidate    = revalidate != nullptr;
+    if(revalidate)
+        request.meta = *revalidate;
+    this->request_queue.push({priority, this->request_sequence++, url});
+    this->send_requests();
+}
+
+void TownFileCache::raise_priority(const std::string &url, AssetPriority priority) {
+    auto find_request = this->pending_requests.find(url);
+    if(find_request == this->pending_requests.end())
+        return;
+    asset_request &request = (*find_request).second;
+    if(priority >= request.priority)
+        return;
+    request.priority = priority;
+    // The old queue entry stops matching and gets skipped
+    if(!request.checking_disk && !request.reply) {
+        this->request_queue.push({priority, this->request_sequence++, url});
+        this->send_requests();
+    }
+}
+
+void TownFileCache::send_requests() {
+    std::vector<queued_request> host_busy;
+    while(!this->request_queue.empty()) {
+        queued_request queued = this->request_queue.top();
+        this->request_queue.pop();
+        auto find_request = this->pending_requests.find(queued.url);
+        if(find_request == this->pending_requests.end())
+            continue;
+        asset_request &request = (*find_request).second;
+        if(request.checking_disk || request.reply || request.priority != queued.priority)
+            continue;
+
+        QUrl qurl(QString::fromUtf8(queued.url));
+        std::string host = qurl.host().toStdString();
+        int &host_requests = this->requests_per_host[host];
+        if(host_requests >= MAX_REQUESTS_PER_HOST) {
+            host_busy.push_back(queued);
+            continue;
+        }
+        host_requests++;
+
+        QNetworkRequest network_request(qurl);
+        network_request.setAttribute(QNetworkRequest::User, QString::fromStdString(queued.url));
+        if(request.revalidate) {
+            // Ask the server to only send the file if it's changed since the cached copy
+            if(!request.meta.etag.isEmpty())
+                network_request.setRawHeader("If-None-Match", request.meta.etag);
+            if(!request.meta.last_modified.isEmpty())
+                network_request.setRawHeader("If-Modified-Since", request.meta.last_modified);
+        }
+        request.host  = host;
+        request.reply = this->network_access_manager.get(network_request);
+    }
+    for(const queued_request &queued : host_busy)
+        this->request_queue.push(queued);
+}
+
+void TownFileCache::begin_map(const std::unordered_set<std::string> &urls) {
+    // Collect the replies first, because aborting one emits finished() right away
+    std::vector<QNetworkReply*> cancelled;
+    for(auto it = this->pending_requests.begin(); it != this->pending_requests.end(); ) {
+        asset_request &request = (*it).second;
+        if(request.checking_disk || urls.find((*it).first) != urls.end()) {
+            ++it;
+            continue;
+        }
+        if(request.reply) {
+            this->requests_per_host[request.host]--;
+            cancelled.push_back(request.reply);
+        }
+        this->requested_urls.erase((*it).first);
+        it = this->pending_requests.erase(it);
+    }
+    for(QNetworkReply *reply : cancelled)
+        reply->abort();
+
+    // Failed downloads for the old map can wait until something asks for them again
+    for(auto &[url, failed] : this->failed_downloads) {
+        if(failed.retry_scheduled && urls.find(url) == urls.end()) {
+            failed.retry_scheduled = false;
+            this->requested_urls.erase(url);
+        }
+    }
+
+    for(const std::string &url : urls) {
+        if(this->image_for_url.find(url) == this->image_for_url.end())
+            this->get_pixmap(url, ASSET_PRIORITY_PREFETCH);
+    }
+    this->send_requests();
+}
+
+void TownFileCache::download_failed(const std::string &url, AssetPriority priority) {
+    // If there's a copy from the disk cache, keep using it
+    if(this->image_for_url.find(url) != this->image_for_url.end())
+        return;
+
+    failed_download &failed = this->failed_downloads[url];
+    failed.failures++;
+    qint64 delay = std::min((qint64)RETRY_DELAY_MIN_MS << std::min(failed.failures - 1, 16), (qint64)RETRY_DELAY_MAX_MS);
+    failed.retry_at = QDateTime::currentMSecsSinceEpoch() + delay;
+    failed.priority = priority;
+    failed.retry_scheduled = true; // Stays in requested_urls until then
+    this->schedule_retries();
+}
+
+void TownFileCache::schedule_retries() {
+    qint64 next_retry = -1;
+    for(const auto &[url, failed] : this->failed_downloads) {
+        if(failed.retry_scheduled && (next_retry < 0 || failed.retry_at < next_retry))
+            next_retry = failed.retry_at;
+    }
+    if(next_retry < 0)
+        this->retry_timer.stop();
+    else
+        this->retry_timer.start((int)std::max(next_retry - QDateTime::currentMSecsSinceEpoch(), (qint64)0));
+}
 
+void TownFileCache::retry_downloads() {
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for(auto &[url, failed] : this->failed_downloads) {
+        if(failed.retry_scheduled && failed.retry_at <= now) {
+            failed.retry_scheduled = false;
+            this->queue_request(url, failed.priority, nullptr);
+        }
+    }
+    this->schedule_retries();
+}
+
+void TownFileCache::onFileDownloaded(QNetworkReply* reply) {
     reply->deleteLater();
+    std::string url = reply->request().attribute(QNetworkRequest::User).toString().toStdString();
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
+    // Cancelled requests were already forgotten about in begin_map()
+    auto find_request = this->pending_requests.find(url);
+    if(find_request == this->pending_requests.end() || (*find_request).second.reply != reply)
+        return;
+    AssetPriority priority = (*find_request).second.priority;
+    this->requests_per_host[(*find_request).second.host]--;
+    this->pending_requests.erase(find_request);
+    this->send_requests();
+
+    if(reply->error() != QNetworkReply::NoError) {
+        this->download_failed(url, priority);
+        return;
+    }
+
+    disk_cache_meta meta;
+    meta.etag          = reply->hasRawHeader("ETag") ? reply->rawHeader("ETag") : reply->request().rawHeader("If-None-Match");
+    meta.last_modified = reply->hasRawHeader("Last-Modified") ? reply->rawHeader("Last-Modified") : reply->request().rawHeader("If-Modified-Since");
+    meta.fetched_at    = QDateTime::currentSecsSinceEpoch();
+
+    if(status == 304) {
+        // The copy loaded from the disk cache is still current
+        this->save_to_disk_cache(url, nullptr, meta);
+        this->failed_downloads.erase(url);
+        if(this->image_for_url.find(url) == this->image_for_url.end())
+            this->requested_urls.erase(url); // Lost the copy in the meantime, so let it be requested again
+        return;
+    }
+
+    this->start_decode(url, reply->readAll(), DECODE_DOWNLOAD, priority, meta);
+}
+
+void TownFileCache::add_image(const std::string &url, const QImage &image) {
+    this->requested_urls.insert(url);
+    this->store_file(url, QByteArray(), image);
+    this->revision++;
+    emit this->request_redraw();
 }
 
-QPixmap *TownFileCache::get_pixmap(const std::string &url) {
+const PixmapRegion *TownFileCache::get_pixmap(const std::string &url, AssetPriority priority) {
     auto find_image = this->image_for_url.find(url);
     if(find_image == this->image_for_url.end()) {
         if(this->requested_urls.find(url) != this->requested_urls.end()) {
+            this->raise_priority(url, priority);
             return nullptr;
         }
+        auto find_failed = this->failed_downloads.find(url);
+        if(find_failed != this->failed_downloads.end() && QDateTime::currentMSecsSinceEpoch() < (*find_failed).second.retry_at)
+            return nullptr;
         this->requested_urls.insert(url);
 
-        QNetworkRequest request((QUrl(QString::fromUtf8(url))));
-        this->network_access_manager.get(request);
+        // Use the disk cache if possible; that'll check back with the server if the copy is old
+        if(!this->disk_cache_directory.isEmpty()) {
+            asset_request &request = this->pending_requests[url];
+            request.priority      = priority;
+            request.checking_disk = true;
+            this->start_decode(url, QByteArray(), DECODE_DISK, priority, disk_cache_meta());
+        } else {
+            this->queue_request(url, priority, nullptr);
+        }
+        return nullptr;
+    }
+
+    cached_file &file = (*find_image).second;
+    if(file.evicted) {
+        if(file.decoding) {
+            this->raise_priority(url, priority);
+        } else {
+            // If it's not on disk either, this is what it'll be downloaded with
+            asset_request &request = this->pending_requests[url];
+            if(!request.reply) {
+                request.priority      = priority;
+                request.checking_disk = true;
+            }
+            file.decoding = true;
+            this->start_decode(url, file.data, DECODE_EVICTED, priority, disk_cache_meta());
+        }
         return nullptr;
     }
-    return &(*find_image).second;
+    if(file.in_lru)
+        this->touch(url, file);
+    return &file.region;
 }
@@ -2,20 +2,41 @@
 #define TOWNFILECACHE_H
 
 #include <string>
+#include <deque>
+#include <list>
+#include <queue>
+#include <vector>
 #include <unordered_map>
 #include <unordered_set>
+#include <stdint.h>
 
 #ifdef USING_QT
 #include <QObject>
 #include <QByteArray>
+#include <QString>
 #include <QNetworkAccessManager>
 #include <QNetworkRequest>
 #include <QNetworkReply>
+#include <QImage>
+#include <QRect>
+#include <QThreadPool>
+#include <QTimer>
 #include <qpixmap.h>
+#include "town.h"
 #else
 #include <curl/curl.h>
 #endif
 
+class TilemapTownClient;
+
+#ifdef USING_QT
+// Where an image is; small images share atlas pages with other images, so the rectangle may not start at 0,0
+struct PixmapRegion {
+    const QPixmap *pixmap = nullptr;
+    QRect rect;
+};
+#endif
+
 #ifndef USING_QT
 struct http_file {
     uint8_t *memory;
@@ -43,12 +64,114 @@ class TownFileCache
 /////////////////////////////////////////////////
 public:
     TownFileCache();
+    uint32_t revision = 0; // Incremented every time a new image becomes available
+    uint32_t replaced_revision = 0; // Incremented when a download replaces an image that may already have been drawn
+    TilemapTownClient *client = nullptr; // Asked which images are in use, so they aren't evicted
 
 #ifdef USING_QT
 private:
-    std::unordered_map<std::string, QPixmap> image_for_url;
+    // Decoded images are evicted least-recently-used first once they go over a memory budget,
+    // and decoded again from the file's raw bytes (or the disk cache) the next time they're needed
+    struct cached_file {
+        PixmapRegion region;   // Points at pixmap, or at an atlas page
+        QPixmap pixmap;        // Unused if the image is in an atlas
+        int atlas_page = -1;
+        int atlas_cell;
+        QByteArray data;       // Raw file contents; empty if evicted
+        bool evicted = false;  // Image was dropped and needs to be decoded again
+        bool decoding = false; // Being decoded again on decode_pool
+        bool in_lru = false;
+        std::list<std::string>::iterator lru_position;
+    };
+    std::unordered_map<std::string, cached_file> image_for_url;
+    std::list<std::string> lru; // Most recently used at the front
+    size_t decoded_bytes = 0, raw_bytes = 0;
+    bool trim_scheduled = false;
+
+    cached_file &store_file(const std::string &url, const QByteArray &data, const QImage &image);
+    void touch(const std::string &url, cached_file &file);
+    void schedule_trim();
+    void trim();
+
+    // Images small enough are packed into big shared pixmaps, so drawing many of them doesn't switch source pixmaps as much.
+    // Each page is split into equal square cells, and images go in a page with the smallest cell size they fit in.
+    // A page counts toward decoded_bytes in full for as long as it exists, and it's released once its last image is gone.
+    struct atlas_page {
+        QPixmap pixmap;
+        int cell_size = 0; // 0 if the page was released and can be reused for any cell size
+        std::vector<int> free_cells;
+    };
+    std::deque<atlas_page> atlas_pages; // Deque so that pointers to the pixmaps stay valid when adding more
+    bool add_to_atlas(cached_file &file, const QImage &image);
+    void remove_from_atlas(cached_file &file);
+    void drop_image(cached_file &file);
+
+    // Disk cache, one file per URL named after the URL's SHA-1, plus a ".meta" file next to it
+    struct disk_cache_meta {
+        QByteArray etag;
+        QByteArray last_modified;
+        qint64 fetched_at = 0;   // Seconds since epoch that the server last confirmed this copy
+    };
+    QString disk_cache_directory;
+    QString disk_cache_path(const std::string &url) const;
+    bool load_from_disk_cache(const std::string &url, QByteArray &data, disk_cache_meta &meta) const;
+    void save_to_disk_cache(const std::string &url, const QByteArray *data, const disk_cache_meta &meta) const;
+
+    // Downloads wait in request_queue and are sent most urgent first, with only a few at a time per host
+    struct asset_request {
+        AssetPriority priority = ASSET_PRIORITY_PREFETCH;
+        bool checking_disk = false; // Waiting to hear back from the disk cache before deciding to download
+        bool revalidate = false;
+        disk_cache_meta meta;       // Sent along with the request if revalidating
+        QNetworkReply *reply = nullptr;
+        std::string host;
+    };
+    struct queued_request {
+        AssetPriority priority;
+        uint64_t sequence;
+        std::string url;
+        bool operator<(const queued_request &other) const { // priority_queue puts the largest first
+            if(this->priority != other.priority)
+                return this->priority > other.priority;
+            return this->sequence > other.sequence;
+        }
+    };
+    std::unordered_map<std::string, asset_request> pending_requests; // Not downloaded yet
+    std::priority_queue<queued_request> request_queue;               // May have stale entries, which send_requests() skips
+    std::unordered_map<std::string, int> requests_per_host;
+    uint64_t request_sequence = 0;
+
+    void queue_request(const std::string &url, AssetPriority priority, const disk_cache_meta *revalidate);
+    void raise_priority(const std::string &url, AssetPriority priority);
+    void send_requests();
+
+    // Failed downloads are tried again later, waiting twice as long after each failure
+    struct failed_download {
+        int failures = 0;
+        qint64 retry_at = 0;          // In milliseconds since epoch; nothing asks the server for it before then
+        AssetPriority priority = ASSET_PRIORITY_PREFETCH;
+        bool retry_scheduled = false; // retry_timer will queue it again, instead of waiting for something to ask for it
+    };
+    std::unordered_map<std::string, failed_download> failed_downloads;
+    QTimer retry_timer;
+    void download_failed(const std::string &url, AssetPriority priority);
+    void schedule_retries();
+    void retry_downloads();
+
+    // Images are decoded into QImages on decode_pool, and only turned into QPixmaps on the UI thread
+    enum decode_source {
+        DECODE_DOWNLOAD, // Just downloaded; saved to the disk cache if it decodes
+        DECODE_DISK,     // First use this session, read from the disk cache
+        DECODE_EVICTED,  // Decoded before, but the pixmap was evicted
+    };
+    int decodes_in_progress = 0;
+    void start_decode(const std::string &url, const QByteArray &data, decode_source source, AssetPriority priority, const disk_cache_meta &meta);
+    void finish_decode(const std::string &url, const QByteArray &data, const QImage &image, decode_source source, AssetPriority priority, const disk_cache_meta &meta);
 public:
-    QPixmap *get_pixmap(const std::string &url);
+    const PixmapRegion *get_pixmap(const std::string &url, AssetPriority priority = ASSET_PRIORITY_VISIBLE_TILE);
+    void begin_map(const std::unordered_set<std::string> &urls); // Cancels downloads the new map doesn't use, and prefetches the ones it does
+    void add_image(const std::string &url, const QImage &image); // For images that don't come from a server, like a benchmark's
+    bool is_busy() const { return !this->pending_requests.empty() || this->decodes_in_progress > 0; } // Still downloading or decoding something
 #elif defined(__3DS__)
 private:
     std::unordered_map<std::string, MultiTextureInfo> image_for_url;
@@ -73,7 +196,11 @@ private:
 #endif
 
 private:
-    std::unordered_set<std::string> requested_urls; // HTTP request was already sent
+    std::unordered_set<std::string> requested_urls; // Requested, or waiting for a retry; anything else gets requested when asked for
+
+#ifdef USING_QT
+    QThreadPool decode_pool; // Last, so it finishes its jobs before anything else is destroyed
+#endif
 };
 
 #endif // TOWNFILECACHE_H